@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lispy.h"
+#include "dict.h"
+
+/* Hashing. Values that lval_eq says are equal hash the same, which
+   means a hash also covers the type, as 1 and 1.0 are not equal */
+
+static unsigned mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned)x;
+}
+
+/* FNV-1a */
+static unsigned hash_str(const char* s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int lval_hashable(lval* v) {
+    switch (v->type) {
+        case LVAL_LONG:
+        case LVAL_FLOAT:
+        case LVAL_BOOL:
+        case LVAL_STR:
+        case LVAL_SYM:
+        case LVAL_FRAC:
+            return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                if (!lval_hashable(list_index(v->cell, i))) { return 0; }
+            }
+            return 1;
+        case LVAL_UVAL:
+            return lval_hashable(v->fields);
+        case LVAL_VEC:
+            for (int i = 0; i < v->vec.len; i++) {
+                if (!lval_hashable(lvec_get(&v->vec, i))) { return 0; }
+            }
+            return 1;
+    }
+    return 0;
+}
+
+unsigned lval_hash(lval* v) {
+    unsigned h = v->type * 16777619u;
+    switch (v->type) {
+        case LVAL_LONG:
+            return h ^ mix(v->inum);
+        case LVAL_FLOAT:
+        case LVAL_BOOL: {
+            // 0.0 and -0.0 are equal
+            double d = v->num == 0 ? 0 : v->num;
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            return h ^ mix(bits);
+        }
+        case LVAL_STR:
+            return h ^ hash_str(v->str);
+        case LVAL_SYM:
+            return h ^ v->hash;
+        case LVAL_FRAC:
+            return h ^ mix((uint64_t)v->numer * 31u + (uint64_t)v->denom);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                h = (h ^ lval_hash(list_index(v->cell, i))) * 16777619u;
+            }
+            return h;
+        case LVAL_UVAL:
+            return h ^ hash_str(v->type_name) ^ lval_hash(v->fields);
+        case LVAL_VEC:
+            for (int i = 0; i < v->vec.len; i++) {
+                h = (h ^ lval_hash(lvec_get(&v->vec, i))) * 16777619u;
+            }
+            return h;
+    }
+    return h;
+}
+
+static int same_key(hentry* x, lval* key, unsigned hash) {
+    if (x->hash != hash) { return 0; }
+    if (x->key == key) { return 1; }
+    lval* r = lval_eq(x->key, key);
+    int same = (int) r->num;
+    lval_del(r);
+    return same;
+}
+
+/* Nodes. A node at shift 32 or more is past the end of the hash and
+   holds colliding keys unindexed */
+
+#define HBITS 5
+
+static hnode* hnode_alloc(int count) {
+    hnode* n = malloc(sizeof(hnode) + sizeof(hentry) * count);
+    n->refs = 1;
+    n->bitmap = 0;
+    n->count = count;
+    return n;
+}
+
+hnode* hnode_retain(hnode* n) {
+    __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+void hnode_release(hnode* n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+    for (int i = 0; i < n->count; i++) {
+        hentry* x = &n->entries[i];
+        if (x->key) {
+            lval_del(x->key);
+            lval_del(x->val);
+        } else {
+            hnode_release(x->child);
+        }
+    }
+    free(n);
+}
+
+/* a version of n that is safe to update, copied if it is shared */
+static hnode* hnode_own(hnode* n) {
+    if (__atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1) { return n; }
+    hnode* c = hnode_alloc(n->count);
+    c->bitmap = n->bitmap;
+    memcpy(c->entries, n->entries, sizeof(hentry) * n->count);
+    for (int i = 0; i < c->count; i++) {
+        hentry* x = &c->entries[i];
+        if (x->key) {
+            lval_retain(x->key);
+            lval_retain(x->val);
+        } else {
+            hnode_retain(x->child);
+        }
+    }
+    hnode_release(n);
+    return c;
+}
+
+/* where the branch for hash is, or would go, in n */
+static int hnode_index(hnode* n, int shift, unsigned hash, unsigned* bit) {
+    *bit = 1u << ((hash >> shift) & 31);
+    return __builtin_popcount(n->bitmap & (*bit - 1));
+}
+
+/* insert x at i in an owned node */
+static hnode* hnode_insert(hnode* n, int i, hentry x) {
+    n = realloc(n, sizeof(hnode) + sizeof(hentry) * (n->count + 1));
+    memmove(&n->entries[i + 1], &n->entries[i], sizeof(hentry) * (n->count - i));
+    n->entries[i] = x;
+    n->count++;
+    return n;
+}
+
+static void hnode_erase(hnode* n, int i) {
+    n->count--;
+    memmove(&n->entries[i], &n->entries[i + 1], sizeof(hentry) * (n->count - i));
+}
+
+/* put x below n, which may be NULL. consumes n and x, returns the
+   node to replace n with */
+static hnode* hnode_put(hnode* n, int shift, hentry x, int* added) {
+    n = n ? hnode_own(n) : hnode_alloc(0);
+
+    if (shift >= 32) {
+        for (int i = 0; i < n->count; i++) {
+            if (same_key(&n->entries[i], x.key, x.hash)) {
+                lval_del(n->entries[i].val);
+                lval_del(x.key);
+                n->entries[i].val = x.val;
+                return n;
+            }
+        }
+        *added = 1;
+        return hnode_insert(n, n->count, x);
+    }
+
+    unsigned bit;
+    int i = hnode_index(n, shift, x.hash, &bit);
+    if (!(n->bitmap & bit)) {
+        *added = 1;
+        n = hnode_insert(n, i, x);
+        n->bitmap |= bit;
+        return n;
+    }
+
+    hentry* y = &n->entries[i];
+    if (y->key == NULL) {
+        y->child = hnode_put(y->child, shift + HBITS, x, added);
+    } else if (same_key(y, x.key, x.hash)) {
+        lval_del(y->val);
+        lval_del(x.key);
+        y->val = x.val;
+    } else {
+        // two keys on one branch, push both a level down
+        int moved = 0;
+        hnode* c = hnode_put(NULL, shift + HBITS, *y, &moved);
+        y->key = NULL;
+        y->child = hnode_put(c, shift + HBITS, x, added);
+    }
+    return n;
+}
+
+/* remove key, known to be below n. returns the node to replace n
+   with, NULL if it is left empty */
+static hnode* hnode_remove(hnode* n, int shift, lval* key, unsigned hash) {
+    n = hnode_own(n);
+    int i;
+    unsigned bit = 0;
+    if (shift >= 32) {
+        for (i = 0; !same_key(&n->entries[i], key, hash); i++) {}
+    } else {
+        i = hnode_index(n, shift, hash, &bit);
+    }
+
+    hentry* y = &n->entries[i];
+    if (y->key == NULL) {
+        hnode* c = hnode_remove(y->child, shift + HBITS, key, hash);
+        if (c && (c->count > 1 || c->entries[0].key == NULL)) {
+            y->child = c;
+            return n;
+        }
+        if (c) {
+            // a single key left below, hoist it here
+            hentry z = c->entries[0];
+            lval_retain(z.key);
+            lval_retain(z.val);
+            hnode_release(c);
+            *y = z;
+            return n;
+        }
+    } else {
+        lval_del(y->key);
+        lval_del(y->val);
+    }
+
+    hnode_erase(n, i);
+    n->bitmap &= ~bit;
+    if (n->count == 0) {
+        free(n);
+        return NULL;
+    }
+    return n;
+}
+
+static int hnode_traverse(hnode* n, int (*fn)(lval*, lval*, void*), void* arg) {
+    for (int i = 0; i < n->count; i++) {
+        hentry* x = &n->entries[i];
+        if (x->key) {
+            if (!fn(x->key, x->val, arg)) { return 0; }
+        } else if (!hnode_traverse(x->child, fn, arg)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Tables */
+
+void ltable_init(ltable* t) {
+    t->count = 0;
+    t->root = NULL;
+}
+
+void ltable_free(ltable* t) {
+    if (t->root) { hnode_release(t->root); }
+    ltable_init(t);
+}
+
+void ltable_copy(ltable* dst, ltable* src) {
+    dst->count = src->count;
+    dst->root = src->root ? hnode_retain(src->root) : NULL;
+}
+
+lval* ltable_get(ltable* t, lval* key, unsigned hash) {
+    hnode* n = t->root;
+    for (int shift = 0; n; shift += HBITS) {
+        if (shift >= 32) {
+            for (int i = 0; i < n->count; i++) {
+                if (same_key(&n->entries[i], key, hash)) { return n->entries[i].val; }
+            }
+            return NULL;
+        }
+        unsigned bit;
+        int i = hnode_index(n, shift, hash, &bit);
+        if (!(n->bitmap & bit)) { return NULL; }
+        hentry* x = &n->entries[i];
+        if (x->key) { return same_key(x, key, hash) ? x->val : NULL; }
+        n = x->child;
+    }
+    return NULL;
+}
+
+int ltable_put(ltable* t, lval* key, unsigned hash, lval* v) {
+    hentry x = { key, { v }, hash };
+    int added = 0;
+    t->root = hnode_put(t->root, 0, x, &added);
+    t->count += added;
+    return added;
+}
+
+int ltable_remove(ltable* t, lval* key, unsigned hash) {
+    if (ltable_get(t, key, hash) == NULL) { return 0; }
+    t->root = hnode_remove(t->root, 0, key, hash);
+    t->count--;
+    return 1;
+}
+
+void ltable_traverse(ltable* t, int (*fn)(lval*, lval*, void*), void* arg) {
+    if (t->root) { hnode_traverse(t->root, fn, arg); }
+}
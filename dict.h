@@ -0,0 +1,53 @@
+#ifndef LISPY_DICT_H
+#define LISPY_DICT_H
+
+struct lval;
+
+/* hash of a value, consistent with lval_eq. only numbers, booleans,
+   strings, symbols, fractions and lists or vectors of them can be hashed */
+int      lval_hashable(struct lval* v);
+unsigned lval_hash(struct lval* v);
+
+/* A table keyed by values, for dicts. It is a hash array mapped trie:
+   each node indexes up to 32 branches by 5 bits of the hash, keeping
+   only the ones in use, packed in order. Nodes are reference counted
+   and shared between versions of a table, so an update copies the
+   path down to the key and nothing else. Below the last bits of the
+   hash, keys whose hashes are all equal share a plain array */
+typedef struct hentry {
+    struct lval* key;         /* NULL for a branch to a child node */
+    union {
+        struct lval* val;
+        struct hnode* child;
+    };
+    unsigned hash;
+} hentry;
+
+typedef struct hnode {
+    int refs;
+    unsigned bitmap;          /* which branches are present */
+    int count;
+    hentry entries[];
+} hnode;
+
+typedef struct ltable {
+    int count;
+    hnode* root;
+} ltable;
+
+void ltable_init(ltable* t);
+void ltable_free(ltable* t);
+/* dst shares src's nodes until either is updated */
+void ltable_copy(ltable* dst, ltable* src);
+struct lval* ltable_get(ltable* t, struct lval* key, unsigned hash);
+/* takes key and v, returns 1 if the key is new */
+int  ltable_put(ltable* t, struct lval* key, unsigned hash, struct lval* v);
+/* returns 1 if the key was there */
+int  ltable_remove(ltable* t, struct lval* key, unsigned hash);
+/* calls fn for each key and value until it returns 0 */
+void ltable_traverse(ltable* t, int (*fn)(struct lval*, struct lval*, void*), void* arg);
+
+hnode* hnode_retain(hnode* n);
+void   hnode_release(hnode* n);
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "lispy.h"
+#include "vm.h"
+#include "slab.h"
+
+/* Collector. Reference counts free almost everything as soon as it
+   is dropped, but a value whose count never reaches zero, because of
+   a cycle or a reference lost on an error path, stays allocated for
+   good. At a safe point, when nothing but the global env and the
+   threads hold values, this marks everything reachable from them and
+   frees every other lval in the slab pool.
+
+   A garbage value may hold references to live ones, those are
+   released normally. References between garbage values are not
+   followed, each one is freed exactly once by the sweep */
+
+/* a set of pointers, open addressing */
+typedef struct ptrset {
+    void** items;
+    int count;
+    int cap;
+} ptrset;
+
+static unsigned ptr_hash(void* p) {
+    uintptr_t x = (uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned)x;
+}
+
+static int ptrset_has(ptrset* s, void* p) {
+    if (s->cap == 0) { return 0; }
+    int i = ptr_hash(p) & (s->cap - 1);
+    while (s->items[i]) {
+        if (s->items[i] == p) { return 1; }
+        i = (i + 1) & (s->cap - 1);
+    }
+    return 0;
+}
+
+/* returns 1 if p was not already in the set */
+static int ptrset_add(ptrset* s, void* p) {
+    if ((s->count + 1) * 2 > s->cap) {
+        ptrset n = { NULL, 0, s->cap ? s->cap * 2 : 1024 };
+        n.items = calloc(n.cap, sizeof(void*));
+        for (int i = 0; i < s->cap; i++) {
+            if (s->items[i]) { ptrset_add(&n, s->items[i]); }
+        }
+        free(s->items);
+        *s = n;
+    }
+    int i = ptr_hash(p) & (s->cap - 1);
+    while (s->items[i]) {
+        if (s->items[i] == p) { return 0; }
+        i = (i + 1) & (s->cap - 1);
+    }
+    s->items[i] = p;
+    s->count++;
+    return 1;
+}
+
+typedef struct gc {
+    ptrset marked;    /* reachable lvals, envs, code and trie nodes */
+    ptrset garbage;   /* lvals to free */
+    ptrset freed;     /* garbage envs, code and nodes already freed */
+} gc;
+
+/* Mark */
+
+static void mark_val(gc* g, lval* v);
+
+static void mark_env(gc* g, lenv* e) {
+    for (; e && ptrset_add(&g->marked, e); e = e->par) {
+        for (int i = 0; i < e->nslots; i++) {
+            if (e->slots[i].val) { mark_val(g, e->slots[i].val); }
+        }
+        for (int i = 0; i < e->syms.cap; i++) {
+            if (e->syms.entries[i].key) { mark_val(g, e->syms.entries[i].val); }
+        }
+    }
+}
+
+static void mark_code(gc* g, lcode* c) {
+    if (!ptrset_add(&g->marked, c)) { return; }
+    for (int i = 0; i < c->nconsts; i++) { mark_val(g, c->consts[i]); }
+}
+
+static void mark_node(gc* g, hnode* n) {
+    if (!ptrset_add(&g->marked, n)) { return; }
+    for (int i = 0; i < n->count; i++) {
+        hentry* x = &n->entries[i];
+        if (x->key) {
+            mark_val(g, x->key);
+            mark_val(g, x->val);
+        } else {
+            mark_node(g, x->child);
+        }
+    }
+}
+
+static void mark_vnode(gc* g, vnode* n, int shift) {
+    if (!ptrset_add(&g->marked, n)) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (shift == 0) {
+            mark_val(g, n->vals[i]);
+        } else {
+            mark_vnode(g, n->kids[i], shift - VEC_BITS);
+        }
+    }
+}
+
+static void mark_val(gc* g, lval* v) {
+    if (!ptrset_add(&g->marked, v)) { return; }
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                mark_val(g, list_index(v->cell, i));
+            }
+            break;
+        case LVAL_FUN:
+            if (!v->builtin) {
+                mark_env(g, v->env);
+                mark_val(g, v->formals);
+                mark_val(g, v->body);
+                mark_code(g, v->code);
+            }
+            break;
+        case LVAL_UTYPE:
+        case LVAL_UVAL:
+            mark_val(g, v->fields);
+            break;
+        case LVAL_DICT:
+        case LVAL_SET:
+            if (v->table.root) { mark_node(g, v->table.root); }
+            break;
+        case LVAL_VEC:
+            if (v->vec.root) { mark_vnode(g, v->vec.root, v->vec.shift); }
+            break;
+    }
+}
+
+static void gc_root_env(void* g, lenv* e) { mark_env(g, e); }
+static void gc_root_val(void* g, lval* v) { mark_val(g, v); }
+
+/* Sweep */
+
+static void find_garbage(void* obj, void* arg) {
+    gc* g = arg;
+    if (!ptrset_has(&g->marked, obj)) { ptrset_add(&g->garbage, obj); }
+}
+
+/* drop a reference held by a garbage value */
+static void release_val(gc* g, lval* v) {
+    if (!ptrset_has(&g->garbage, v)) { lval_del(v); }
+}
+
+static void release_env(gc* g, lenv* e) {
+    if (ptrset_has(&g->marked, e)) { lenv_del(e); return; }
+    if (!ptrset_add(&g->freed, e)) { return; }
+    // release what it binds, then free the empty env
+    for (int i = 0; i < e->nslots; i++) {
+        if (e->slots[i].val) { release_val(g, e->slots[i].val); }
+        e->slots[i].val = NULL;
+    }
+    for (int i = 0; i < e->syms.cap; i++) {
+        if (e->syms.entries[i].key) { release_val(g, e->syms.entries[i].val); }
+    }
+    symtab_free(&e->syms);
+    e->refs = 1;
+    lenv_del(e);
+}
+
+static void release_code(gc* g, lcode* c) {
+    if (ptrset_has(&g->marked, c)) { lcode_release(c); return; }
+    if (!ptrset_add(&g->freed, c)) { return; }
+    for (int i = 0; i < c->nconsts; i++) { release_val(g, c->consts[i]); }
+    c->nconsts = 0;
+    c->refs = 1;
+    lcode_release(c);
+}
+
+static void release_node(gc* g, hnode* n) {
+    if (ptrset_has(&g->marked, n)) { hnode_release(n); return; }
+    if (!ptrset_add(&g->freed, n)) { return; }
+    for (int i = 0; i < n->count; i++) {
+        hentry* x = &n->entries[i];
+        if (x->key) {
+            release_val(g, x->key);
+            release_val(g, x->val);
+        } else {
+            release_node(g, x->child);
+        }
+    }
+    n->count = 0;
+    n->refs = 1;
+    hnode_release(n);
+}
+
+static void release_vnode(gc* g, vnode* n, int shift) {
+    if (ptrset_has(&g->marked, n)) { vnode_release(n, shift); return; }
+    if (!ptrset_add(&g->freed, n)) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (shift == 0) {
+            release_val(g, n->vals[i]);
+        } else {
+            release_vnode(g, n->kids[i], shift - VEC_BITS);
+        }
+    }
+    n->count = 0;
+    n->refs = 1;
+    vnode_release(n, shift);
+}
+
+static void free_garbage(gc* g, lval* v) {
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                release_val(g, list_index(v->cell, i));
+            }
+            list_destroy(v->cell);
+            break;
+        case LVAL_STR:
+        case LVAL_ERR:
+            free(v->str);
+            break;
+        case LVAL_FUN:
+            if (!v->builtin) {
+                release_env(g, v->env);
+                release_val(g, v->formals);
+                release_val(g, v->body);
+                release_code(g, v->code);
+            }
+            if (v->doc) { free(v->doc); }
+            break;
+        case LVAL_UTYPE:
+        case LVAL_UVAL:
+            free(v->type_name);
+            release_val(g, v->fields);
+            break;
+        case LVAL_DICT:
+        case LVAL_SET:
+            if (v->table.root) { release_node(g, v->table.root); }
+            break;
+        case LVAL_VEC:
+            if (v->vec.root) { release_vnode(g, v->vec.root, v->vec.shift); }
+            break;
+    }
+    // what is left owns nothing, free it as a plain number
+    v->type = LVAL_LONG;
+    v->refs = 1;
+    lval_del(v);
+}
+
+/* collect from the global env e. must be called where no other lval
+   is held, i.e. between top level forms. returns the number of values
+   freed, or -1 if a thread is still running */
+int lval_gc(lenv* e) {
+    gc g = { {0}, {0}, {0} };
+    if (!lthread_roots(gc_root_env, gc_root_val, &g)) { return -1; }
+    mark_env(&g, e);
+
+    slab_pool_walk(sizeof(lval), find_garbage, &g);
+    for (int i = 0; i < g.garbage.cap; i++) {
+        if (g.garbage.items[i]) { free_garbage(&g, g.garbage.items[i]); }
+    }
+
+    int n = g.garbage.count;
+    free(g.marked.items);
+    free(g.garbage.items);
+    free(g.freed.items);
+    return n;
+}
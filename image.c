@@ -0,0 +1,576 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lispy.h"
+#include "image.h"
+
+/* Layout, all numbers little endian:
+
+     "LSPY" version kind 0 0     8 bytes
+     source length               8 bytes
+     source hash                 8 bytes
+     payload hash                8 bytes, of everything after the header
+     values, then TAG_END
+
+   A value is a tag byte and what that tag needs. Counts, lengths and
+   indexes are unsigned LEB128 varints, integers are zigzag encoded
+   first. A symbol's name is only written the first time, after that
+   it is referred to by the order it first appeared in.
+
+   An image of an env holds a symbol and its value for each binding.
+   Builtins are written by name and found again among a fresh set, a
+   function by its formals and body, which are compiled again, and the
+   arguments it has been given so far */
+
+enum {
+    TAG_END, TAG_LONG, TAG_FLOAT, TAG_TRUE, TAG_FALSE, TAG_STR, TAG_ERR,
+    TAG_SYM, TAG_SYMREF, TAG_SEXPR, TAG_QEXPR, TAG_BUILTIN, TAG_LAMBDA,
+    TAG_FRAC, TAG_UTYPE, TAG_UVAL, TAG_DICT, TAG_SET, TAG_VEC
+};
+
+#define HEADER_SIZE 32
+
+/* FNV-1a, 64 bit */
+uint64_t image_hash(uint64_t h, const char* src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)src[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+char* image_path(const char* src_path) {
+    size_t n = strlen(src_path);
+    char* path = malloc(n + 2);
+    memcpy(path, src_path, n);
+    path[n] = 'c';
+    path[n + 1] = '\0';
+    return path;
+}
+
+/* Writing */
+
+static void put_u64(FILE* f, uint64_t x) {
+    for (int i = 0; i < 8; i++) { putc((int)(x >> (8 * i)) & 0xff, f); }
+}
+
+static void put_varint(FILE* f, uint64_t x) {
+    while (x >= 0x80) {
+        putc((int)(x & 0x7f) | 0x80, f);
+        x >>= 7;
+    }
+    putc((int)x, f);
+}
+
+static void put_bytes(FILE* f, const char* s, size_t n) {
+    put_varint(f, n);
+    fwrite(s, 1, n, f);
+}
+
+int image_out_open(image_out* o, const char* path, int kind, uint64_t hash, size_t len) {
+    // read back on close to hash the payload
+    o->f = fopen(path, "w+b");
+    if (o->f == NULL) { return 0; }
+    symtab_init(&o->syms);
+    o->nsyms = 0;
+    o->builtins = NULL;
+
+    fwrite("LSPY", 1, 4, o->f);
+    putc(IMAGE_VERSION, o->f);
+    putc(kind, o->f);
+    putc(0, o->f);
+    putc(0, o->f);
+    put_u64(o->f, len);
+    put_u64(o->f, hash);
+    put_u64(o->f, 0);
+    return 1;
+}
+
+/* every env starts with these, an image only refers to them */
+static lenv* fresh_builtins(lenv** b) {
+    if (*b == NULL) {
+        *b = lenv_new();
+        lenv_add_builtins(*b);
+    }
+    return *b;
+}
+
+typedef struct builtin_name {
+    lbuiltin fn;
+    char* name;
+} builtin_name;
+
+static int find_builtin(char* name, lval* v, void* arg) {
+    builtin_name* x = arg;
+    if (v->builtin != x->fn) { return 1; }
+    x->name = name;
+    return 0;
+}
+
+static void put_varlong(FILE* f, int64_t x) {
+    put_varint(f, ((uint64_t)x << 1) ^ (uint64_t)(x >> 63));
+}
+
+static int put_entry(lval* key, lval* v, void* arg) {
+    image_write(arg, key);
+    image_write(arg, v);
+    return 1;
+}
+
+static int put_member(lval* key, lval* v, void* arg) {
+    image_write(arg, key);
+    return 1;
+}
+
+void image_write(image_out* o, lval* v) {
+    FILE* f = o->f;
+    switch (v->type) {
+        case LVAL_LONG:
+            putc(TAG_LONG, f);
+            put_varlong(f, v->inum);
+            break;
+        case LVAL_FLOAT: {
+            uint64_t bits;
+            memcpy(&bits, &v->num, sizeof(bits));
+            putc(TAG_FLOAT, f);
+            put_u64(f, bits);
+            break;
+        }
+        case LVAL_BOOL:
+            putc(v->num ? TAG_TRUE : TAG_FALSE, f);
+            break;
+        case LVAL_STR:
+            putc(TAG_STR, f);
+            put_bytes(f, v->str, strlen(v->str));
+            break;
+        case LVAL_ERR:
+            putc(TAG_ERR, f);
+            put_bytes(f, v->str, strlen(v->str));
+            break;
+        case LVAL_SYM: {
+            lval* index = symtab_get(&o->syms, v->str, v->hash);
+            if (index) {
+                putc(TAG_SYMREF, f);
+                put_varint(f, index->inum);
+            } else {
+                symtab_put(&o->syms, v->str, v->hash, lval_long(o->nsyms++));
+                putc(TAG_SYM, f);
+                put_bytes(f, v->str, strlen(v->str));
+            }
+            break;
+        }
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            putc(v->type == LVAL_SEXPR ? TAG_SEXPR : TAG_QEXPR, f);
+            put_varint(f, v->count);
+            for (int i = 0; i < v->count; i++) {
+                image_write(o, list_index(v->cell, i));
+            }
+            break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                builtin_name x = { v->builtin, NULL };
+                symtab_traverse(&fresh_builtins(&o->builtins)->syms, find_builtin, &x);
+                putc(TAG_BUILTIN, f);
+                put_bytes(f, x.name, x.name ? strlen(x.name) : 0);
+                break;
+            }
+            /* the env holds only the arguments bound so far, one slot for
+               each of the formals the function started out with */
+            putc(TAG_LAMBDA, f);
+            image_write(o, v->formals);
+            image_write(o, v->body);
+            put_varint(f, v->env->nslots);
+            for (int i = 0; i < v->env->nslots; i++) {
+                symtab_entry* slot = &v->env->slots[i];
+                lval* sym = lval_sym(slot->key);
+                image_write(o, sym);
+                lval_del(sym);
+                putc(slot->val != NULL, f);
+                if (slot->val) { image_write(o, slot->val); }
+            }
+            break;
+        case LVAL_FRAC:
+            putc(TAG_FRAC, f);
+            put_varlong(f, v->numer);
+            put_varlong(f, v->denom);
+            break;
+        case LVAL_UTYPE:
+        case LVAL_UVAL:
+            putc(v->type == LVAL_UTYPE ? TAG_UTYPE : TAG_UVAL, f);
+            put_bytes(f, v->type_name, strlen(v->type_name));
+            image_write(o, v->fields);
+            break;
+        case LVAL_DICT:
+        case LVAL_SET:
+            putc(v->type == LVAL_DICT ? TAG_DICT : TAG_SET, f);
+            put_varint(f, v->table.count);
+            ltable_traverse(&v->table, v->type == LVAL_DICT ? put_entry : put_member, o);
+            break;
+        case LVAL_VEC:
+            putc(TAG_VEC, f);
+            put_varint(f, v->vec.len);
+            for (int i = 0; i < v->vec.len; i++) {
+                image_write(o, lvec_get(&v->vec, i));
+            }
+            break;
+    }
+}
+
+typedef struct env_out {
+    image_out* o;
+    lenv* builtins;
+} env_out;
+
+static int put_binding(char* name, lval* v, void* arg) {
+    env_out* x = arg;
+    lval* sym = lval_sym(name);
+    lval* fresh = symtab_get(&x->builtins->syms, sym->str, sym->hash);
+    if (!(v->type == LVAL_FUN && v->builtin && fresh && fresh->builtin == v->builtin)) {
+        image_write(x->o, sym);
+        image_write(x->o, v);
+    }
+    lval_del(sym);
+    return 1;
+}
+
+void image_write_env(image_out* o, lenv* e) {
+    env_out x = { o, fresh_builtins(&o->builtins) };
+    symtab_traverse(&e->syms, put_binding, &x);
+}
+
+static int drop_index(char* name, lval* index, void* unused) {
+    lval_del(index);
+    return 1;
+}
+
+/* hash what follows the header and fill it in */
+static int put_payload_hash(FILE* f) {
+    if (fflush(f) != 0 || fseek(f, HEADER_SIZE, SEEK_SET) != 0) { return 0; }
+    uint64_t h = IMAGE_HASH_INIT;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { h = image_hash(h, buf, n); }
+    if (ferror(f) || fseek(f, HEADER_SIZE - 8, SEEK_SET) != 0) { return 0; }
+    put_u64(f, h);
+    return 1;
+}
+
+int image_out_close(image_out* o) {
+    putc(TAG_END, o->f);
+    symtab_traverse(&o->syms, drop_index, NULL);
+    symtab_free(&o->syms);
+    if (o->builtins) { lenv_del(o->builtins); }
+    int ok = put_payload_hash(o->f) && !ferror(o->f);
+    if (fclose(o->f) != 0) { ok = 0; }
+    return ok;
+}
+
+/* Reading. The image may not be what it claims, every read is checked
+   against the end and gives up with in->err set */
+
+static uint64_t get_u64(const unsigned char* p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) { x |= (uint64_t)p[i] << (8 * i); }
+    return x;
+}
+
+static int get_varint(image_in* in, uint64_t* x) {
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (in->p >= in->end) { break; }
+        unsigned char b = *in->p++;
+        *x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { return 1; }
+    }
+    in->err = "bad number";
+    return 0;
+}
+
+/* a length followed by that many bytes */
+static const char* get_bytes(image_in* in, size_t* n) {
+    uint64_t len;
+    if (!get_varint(in, &len)) { return NULL; }
+    if (len > (uint64_t)(in->end - in->p)) {
+        in->err = "cut short";
+        return NULL;
+    }
+    const char* s = (const char*)in->p;
+    in->p += len;
+    *n = len;
+    return s;
+}
+
+int image_in_open(image_in* in, const void* data, size_t size, int kind, size_t len) {
+    const unsigned char* p = data;
+    in->p = p + HEADER_SIZE;
+    in->end = p + size;
+    in->syms = NULL;
+    in->nsyms = 0;
+    in->cap = 0;
+    in->builtins = NULL;
+    in->err = NULL;
+
+    if (size < HEADER_SIZE || memcmp(p, "LSPY", 4) != 0) { return 0; }
+    if (p[4] != IMAGE_VERSION || p[5] != kind) { return 0; }
+    in->hash = get_u64(p + 16);
+    if (get_u64(p + 8) != len) { return 0; }
+
+    /* nothing is read from an image that has been damaged since it
+       was written */
+    if (image_hash(IMAGE_HASH_INIT, (const char*)in->p, size - HEADER_SIZE) != get_u64(p + 24)) {
+        in->err = "bad checksum";
+        return 0;
+    }
+    return 1;
+}
+
+static int get_varlong(image_in* in, int64_t* x) {
+    uint64_t u;
+    if (!get_varint(in, &u)) { return 0; }
+    *x = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return 1;
+}
+
+/* a malloc'd copy of the bytes, NUL terminated */
+static char* get_str(image_in* in) {
+    size_t n;
+    const char* s = get_bytes(in, &n);
+    if (s == NULL) { return NULL; }
+    char* str = malloc(n + 1);
+    memcpy(str, s, n);
+    str[n] = '\0';
+    return str;
+}
+
+static lval* read_val(image_in* in);
+
+/* a value of type, or NULL, which leaves in->err */
+static lval* read_type(image_in* in, int type) {
+    lval* v = read_val(in);
+    if (v && v->type != type) {
+        lval_del(v);
+        in->err = "bad value";
+        return NULL;
+    }
+    return v;
+}
+
+static lval* read_builtin(image_in* in) {
+    char* name = get_str(in);
+    if (name == NULL) { return NULL; }
+    lval* sym = lval_sym(name);
+    free(name);
+    lval* v = symtab_get(&fresh_builtins(&in->builtins)->syms, sym->str, sym->hash);
+    lval_del(sym);
+    if (v == NULL || v->type != LVAL_FUN || !v->builtin) {
+        in->err = "unknown builtin";
+        return NULL;
+    }
+    return lval_retain(v);
+}
+
+static lval* read_lambda(image_in* in) {
+    lval* formals = read_type(in, LVAL_QEXPR);
+    lval* body = formals ? read_type(in, LVAL_QEXPR) : NULL;
+    uint64_t n;
+    if (body == NULL || !get_varint(in, &n) || n > (uint64_t)(in->end - in->p)) {
+        if (in->err == NULL) { in->err = "cut short"; }
+        if (formals) { lval_del(formals); }
+        if (body) { lval_del(body); }
+        return NULL;
+    }
+
+    /* the slots come back in the order of the formals they were made
+       for, so the body compiles the same, then what was bound to them.
+       the formals left unbound replace them afterwards */
+    lval* slots = lval_qexpr();
+    lval** given = calloc(n ? n : 1, sizeof(lval*));
+    for (uint64_t i = 0; i < n && in->err == NULL; i++) {
+        lval* sym = read_type(in, LVAL_SYM);
+        if (sym == NULL) { break; }
+        lval_add(slots, sym);
+        if (strcmp(sym->str, "&") == 0) {
+            in->err = "bad value";
+        } else if (in->p >= in->end) {
+            in->err = "cut short";
+        } else if (*in->p++) {
+            given[i] = read_val(in);
+        }
+    }
+
+    lval* v = NULL;
+    if (in->err == NULL) {
+        v = lval_lambda(slots, body);
+        for (uint64_t i = 0; i < n; i++) {
+            if (given[i]) { lenv_put(v->env, list_index(v->formals->cell, i), given[i]); }
+        }
+        lval_del(v->formals);
+        v->formals = formals;
+    } else {
+        lval_del(slots); lval_del(body); lval_del(formals);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        if (given[i]) { lval_del(given[i]); }
+    }
+    free(given);
+    return v;
+}
+
+static lval* read_val(image_in* in) {
+    if (in->p >= in->end) {
+        in->err = "cut short";
+        return NULL;
+    }
+    int tag = *in->p++;
+    uint64_t x;
+    size_t n;
+    const char* s;
+    switch (tag) {
+        case TAG_LONG:
+            if (!get_varint(in, &x)) { return NULL; }
+            return lval_long((int64_t)(x >> 1) ^ -(int64_t)(x & 1));
+        case TAG_FLOAT: {
+            if (in->end - in->p < 8) {
+                in->err = "cut short";
+                return NULL;
+            }
+            uint64_t bits = get_u64(in->p);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            in->p += 8;
+            return lval_float(d);
+        }
+        case TAG_TRUE:  return lval_bool(1);
+        case TAG_FALSE: return lval_bool(0);
+        case TAG_STR:
+        case TAG_ERR: {
+            char* str = get_str(in);
+            if (str == NULL) { return NULL; }
+            if (tag == TAG_STR) { return lval_str_take(str); }
+            lval* err = lval_err("%s", str);
+            free(str);
+            return err;
+        }
+        case TAG_SYM: {
+            if ((s = get_bytes(in, &n)) == NULL) { return NULL; }
+            if (in->nsyms == in->cap) {
+                in->cap = in->cap ? in->cap * 2 : 64;
+                in->syms = realloc(in->syms, sizeof(lval*) * in->cap);
+            }
+            lval* sym = lval_symn(s, n);
+            in->syms[in->nsyms++] = sym;
+            return lval_retain(sym);
+        }
+        case TAG_SYMREF:
+            if (!get_varint(in, &x)) { return NULL; }
+            if (x >= (uint64_t)in->nsyms) {
+                in->err = "bad symbol";
+                return NULL;
+            }
+            /* symbols are never changed in place, so one is shared */
+            return lval_retain(in->syms[x]);
+        case TAG_SEXPR:
+        case TAG_QEXPR: {
+            if (!get_varint(in, &x)) { return NULL; }
+            lval* v = tag == TAG_SEXPR ? lval_sexpr() : lval_qexpr();
+            for (uint64_t i = 0; i < x; i++) {
+                lval* y = read_val(in);
+                if (y == NULL) {
+                    lval_del(v);
+                    return NULL;
+                }
+                lval_add(v, y);
+            }
+            return v;
+        }
+        case TAG_BUILTIN: return read_builtin(in);
+        case TAG_LAMBDA:  return read_lambda(in);
+        case TAG_FRAC: {
+            int64_t numer, denom;
+            if (!get_varlong(in, &numer) || !get_varlong(in, &denom)) { return NULL; }
+            if (denom <= 1) {
+                in->err = "bad value";
+                return NULL;
+            }
+            return lval_frac(numer, denom);
+        }
+        case TAG_UTYPE:
+        case TAG_UVAL: {
+            char* name = get_str(in);
+            if (name == NULL) { return NULL; }
+            lval* fields = read_type(in, LVAL_QEXPR);
+            lval* v = NULL;
+            if (fields) {
+                v = tag == TAG_UTYPE ? lval_utype(name, fields) : lval_uval(name, fields);
+            }
+            free(name);
+            return v;
+        }
+        case TAG_DICT:
+        case TAG_SET: {
+            if (!get_varint(in, &x)) { return NULL; }
+            lval* v = tag == TAG_DICT ? lval_dict() : lval_set();
+            for (uint64_t i = 0; i < x; i++) {
+                lval* key = read_val(in);
+                lval* y = key && tag == TAG_DICT ? read_val(in) : lval_bool(1);
+                if (key && !lval_hashable(key)) { in->err = "bad key"; }
+                if (key == NULL || y == NULL || in->err) {
+                    if (key) { lval_del(key); }
+                    if (y) { lval_del(y); }
+                    lval_del(v);
+                    return NULL;
+                }
+                ltable_put(&v->table, key, lval_hash(key), y);
+            }
+            return v;
+        }
+        case TAG_VEC: {
+            if (!get_varint(in, &x)) { return NULL; }
+            lval* v = lval_vec();
+            for (uint64_t i = 0; i < x; i++) {
+                lval* y = read_val(in);
+                if (y == NULL) {
+                    lval_del(v);
+                    return NULL;
+                }
+                lvec_push(&v->vec, y);
+            }
+            return v;
+        }
+    }
+    in->err = "unknown tag";
+    return NULL;
+}
+
+lval* image_next(image_in* in) {
+    if (in->err) { return NULL; }
+    if (in->p < in->end && *in->p == TAG_END) { return NULL; }
+    return read_val(in);
+}
+
+int image_read_env(image_in* in, lenv* e) {
+    lval* sym;
+    while ((sym = image_next(in))) {
+        lval* v = sym->type == LVAL_SYM ? read_val(in) : NULL;
+        if (v) {
+            lenv_put(e, sym, v);
+            lval_del(v);
+        } else if (in->err == NULL) {
+            in->err = "bad value";
+        }
+        lval_del(sym);
+        if (in->err) { return 0; }
+    }
+    return in->err == NULL;
+}
+
+void image_in_close(image_in* in) {
+    for (int i = 0; i < in->nsyms; i++) { lval_del(in->syms[i]); }
+    free(in->syms);
+    in->syms = NULL;
+    in->nsyms = 0;
+    if (in->builtins) {
+        lenv_del(in->builtins);
+        in->builtins = NULL;
+    }
+}
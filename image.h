@@ -0,0 +1,72 @@
+#ifndef LISPY_IMAGE_H
+#define LISPY_IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "symtab.h"
+
+struct lval;
+struct lenv;
+
+/* Images: values in a compact binary form, so that what was read from a
+   source file can be cached beside it and loaded again without reading
+   the source. An image starts with a header naming the source it was
+   made from by length and hash, one that doesn't match is passed over,
+   as is one whose contents no longer match the checksum it was written
+   with.
+   The bindings of an env can be imaged too, to start up with them
+   rather than evaluating the code that made them */
+
+#define IMAGE_VERSION 2
+
+/* what an image holds */
+#define IMAGE_FORMS 1       /* the top level forms of a source file */
+#define IMAGE_ENV   2       /* the bindings of the global env */
+
+typedef struct image_out {
+    FILE* f;
+    symtab syms;            /* symbol names written so far, to their index */
+    int nsyms;
+    struct lenv* builtins;  /* a fresh set, to name builtins by */
+} image_out;
+
+typedef struct image_in {
+    const unsigned char* p;
+    const unsigned char* end;
+    struct lval** syms;     /* symbols read so far, by index */
+    int nsyms;
+    int cap;
+    struct lenv* builtins;  /* a fresh set, to find builtins by name */
+    uint64_t hash;          /* of the source it was made from */
+    const char* err;        /* why the image couldn't be read, if it couldn't */
+} image_in;
+
+/* where the image of a source file goes, x.lspy -> x.lspyc. malloc'd */
+char*    image_path(const char* src_path);
+/* hash of a source, which can be taken a piece at a time: start h at
+   IMAGE_HASH_INIT and pass back what each piece returns */
+#define IMAGE_HASH_INIT 14695981039346656037ull
+uint64_t image_hash(uint64_t h, const char* src, size_t len);
+
+/* 0 if path can't be written */
+int  image_out_open(image_out* o, const char* path, int kind, uint64_t hash, size_t len);
+void image_write(image_out* o, struct lval* v);
+/* each binding of e, apart from builtins still bound to their own
+   names, which every env starts with */
+void image_write_env(image_out* o, struct lenv* e);
+/* 0 if anything failed to be written */
+int  image_out_close(image_out* o);
+
+/* 1 if the size bytes at data are an intact image of kind, made from
+   a source len bytes long. whether it has the same hash is up to the
+   caller to check against in->hash. a damaged image leaves in->err set */
+int  image_in_open(image_in* in, const void* data, size_t size, int kind, size_t len);
+/* the next value, NULL after the last or if the image is damaged,
+   which leaves in->err set */
+struct lval* image_next(image_in* in);
+/* puts each binding written by image_write_env into e. 0 if the
+   image is damaged, which leaves in->err set */
+int  image_read_env(image_in* in, struct lenv* e);
+void image_in_close(image_in* in);
+
+#endif
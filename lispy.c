@@ -6,15 +6,18 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
-/* this is only included in *BSD/Mac OS X
-   I prefer it over hsearch because it allows multiple
-   hash tables */
-#include <strhash.h>
 // #include <stdbool.h>
 #include "mpc.h"
 #include "lispy.h"
 #include "list.h"
+#include "vm.h"
+#include "slab.h"
+#include "pool.h"
+#include "reader.h"
+#include "image.h"
 
 #include <editline/readline.h>
 
@@ -23,24 +26,29 @@ static struct termios orig_termios;
 static int term_raw_mode = 0;
 static int random_initialized = 0;
 
-/* Thread support structures */
+/* Thread support structures. spawn queues a task on the worker pool
+   (pool.c) and hands back its id, wait blocks until the task is done */
 typedef struct {
-    pthread_t thread;
     lenv* env;
     lval* expr;
     lval* result;
+    int pending;        /* 1 until the task has run, for pool_wait */
     int completed;
+    int waited;         /* someone is in wait for it already */
 } lthread;
 
 static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* Simple thread pool for tracking */
-#define MAX_THREADS 256
-static lthread* thread_pool[MAX_THREADS];
+/* Tasks by id. an id is free again once its task has been waited for,
+   and free ids are handed out before the table grows */
+static lthread** thread_pool = NULL;
 static int thread_count = 0;
+static int thread_cap = 0;
+static int* free_ids = NULL;
+static int free_count = 0;
 
-/* Thread execution function */
-static void* thread_run(void* arg) {
+/* Task execution function */
+static void thread_run(void* arg) {
     lthread* t = (lthread*)arg;
 
     /* Evaluate the expression in the thread's environment */
@@ -49,8 +57,7 @@ static void* thread_run(void* arg) {
     pthread_mutex_lock(&thread_mutex);
     t->completed = 1;
     pthread_mutex_unlock(&thread_mutex);
-
-    return NULL;
+    pool_done(&t->pending);
 }
 
 /* Length-prefixed string implementation */
@@ -122,48 +129,145 @@ lval* builtin_spawn(lenv* e, lval* a) {
     LASSERT_NUM("spawn", a, 1);
     LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
 
-    pthread_mutex_lock(&thread_mutex);
-    if (thread_count >= MAX_THREADS) {
-        pthread_mutex_unlock(&thread_mutex);
-        lval_del(a);
-        return lval_err("Maximum number of threads (%d) exceeded", MAX_THREADS);
-    }
-
     /* Create thread structure */
     lthread* t = malloc(sizeof(lthread));
-    t->env = lenv_copy(e);
-    t->expr = lval_pop(a, 0);
+    t->env = lenv_snapshot(e);
+    t->expr = lval_unshare(lval_pop(a, 0));
     t->expr->type = LVAL_SEXPR;  /* Convert Q-expr to S-expr for evaluation */
     t->result = NULL;
+    t->pending = 1;
     t->completed = 0;
+    t->waited = 0;
 
     /* Store in pool and get ID */
-    int thread_id = thread_count;
-    thread_pool[thread_count++] = t;
+    pthread_mutex_lock(&thread_mutex);
+    int thread_id;
+    if (free_count > 0) {
+        thread_id = free_ids[--free_count];
+    } else {
+        if (thread_count == thread_cap) {
+            thread_cap = thread_cap ? thread_cap * 2 : 16;
+            thread_pool = realloc(thread_pool, sizeof(lthread*) * thread_cap);
+            free_ids = realloc(free_ids, sizeof(int) * thread_cap);
+        }
+        thread_id = thread_count++;
+    }
+    thread_pool[thread_id] = t;
     pthread_mutex_unlock(&thread_mutex);
 
-    /* Create the thread */
-    if (pthread_create(&t->thread, NULL, thread_run, t) != 0) {
-        pthread_mutex_lock(&thread_mutex);
-        thread_count--;
-        pthread_mutex_unlock(&thread_mutex);
-        lenv_del(t->env);
-        lval_del(t->expr);
-        free(t);
-        lval_del(a);
-        return lval_err("Failed to create thread");
-    }
+    pool_submit(thread_run, t);
 
     lval_del(a);
     return lval_long(thread_id);
 }
 
+/* a run of pmap's list, evaluated by one task */
+typedef struct pmap_chunk {
+    lenv* env;          /* a snapshot of the caller's env, as spawn takes */
+    lval* f;
+    lval* list;
+    lval** out;         /* where the results go, in order */
+    int start;
+    int end;
+    int* pending;
+} pmap_chunk;
+
+static void pmap_run(void* arg) {
+    pmap_chunk* c = arg;
+    for (int i = c->start; i < c->end; i++) {
+        lval* args = lval_add(lval_sexpr(), lval_retain(list_index(c->list->cell, i)));
+        c->out[i] = lval_call(c->env, c->f, args);
+        // no point carrying on past an error
+        if (c->out[i]->type == LVAL_ERR) {
+            for (i++; i < c->end; i++) { c->out[i] = NULL; }
+        }
+    }
+    lenv_snapshot_del(c->env);
+    pool_done(c->pending);
+}
+
+/* Parallel map: (pmap f {1 2 3}) -> results in order. the list is cut
+   into a few chunks per worker, so uneven work still spreads out */
+lval* builtin_pmap(lenv* e, lval* a) {
+    LASSERT_NUM("pmap", a, 2);
+    LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+    LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+    lval* f = list_index(a->cell, 0);
+    lval* l = list_index(a->cell, 1);
+    int n = l->count;
+    int nchunks = pool_size() * 4;
+    if (nchunks > n) { nchunks = n; }
+
+    lval** out = malloc(sizeof(lval*) * (n ? n : 1));
+    pmap_chunk* chunks = malloc(sizeof(pmap_chunk) * (nchunks ? nchunks : 1));
+    int pending = nchunks;
+    for (int i = 0; i < nchunks; i++) {
+        pmap_chunk* c = &chunks[i];
+        c->env = lenv_snapshot(e);
+        c->f = f;
+        c->list = l;
+        c->out = out;
+        c->start = (int)((long)n * i / nchunks);
+        c->end = (int)((long)n * (i + 1) / nchunks);
+        c->pending = &pending;
+        pool_submit(pmap_run, c);
+    }
+    pool_wait(&pending);
+
+    // the first error wins, in list order
+    lval* result = lval_qexpr();
+    list_reserve(result->cell, n);
+    for (int i = 0; i < n; i++) {
+        if (out[i] == NULL) { continue; }
+        if (result->type != LVAL_ERR && out[i]->type == LVAL_ERR) {
+            lval_del(result);
+            result = out[i];
+        } else if (result->type == LVAL_ERR) {
+            lval_del(out[i]);
+        } else {
+            lval_add(result, out[i]);
+        }
+    }
+    free(chunks);
+    free(out);
+    lval_del(a);
+    return result;
+}
+
+lval* builtin_gc(lenv* e, lval* a) {
+    LASSERT_NUM("gc", a, 0);
+    lval_del(a);
+    gc_requested = 1;
+    return lval_nil();
+}
+
+/* hand the collector what the threads hold. returns 0 without calling
+   anything if a thread is still running */
+int lthread_roots(void (*env)(void*, lenv*), void (*val)(void*, lval*), void* arg) {
+    pthread_mutex_lock(&thread_mutex);
+    for (int i = 0; i < thread_count; i++) {
+        if (thread_pool[i] && !thread_pool[i]->completed) {
+            pthread_mutex_unlock(&thread_mutex);
+            return 0;
+        }
+    }
+    for (int i = 0; i < thread_count; i++) {
+        lthread* t = thread_pool[i];
+        if (t == NULL) { continue; }
+        env(arg, t->env);
+        val(arg, t->result);
+    }
+    pthread_mutex_unlock(&thread_mutex);
+    return 1;
+}
+
 /* Wait for a thread to complete: (wait thread-id) -> result */
 lval* builtin_wait(lenv* e, lval* a) {
     LASSERT_NUM("wait", a, 1);
     LASSERT_TYPE("wait", a, 0, LVAL_LONG);
 
-    int thread_id = (int)((lval*)list_index(a->cell, 0))->num;
+    int thread_id = (int)((lval*)list_index(a->cell, 0))->inum;
     lval_del(a);
 
     pthread_mutex_lock(&thread_mutex);
@@ -173,24 +277,27 @@ lval* builtin_wait(lenv* e, lval* a) {
     }
 
     lthread* t = thread_pool[thread_id];
-    if (t == NULL) {
+    if (t == NULL || t->waited) {
         pthread_mutex_unlock(&thread_mutex);
         return lval_err("Thread %d already waited", thread_id);
     }
+    t->waited = 1;
     pthread_mutex_unlock(&thread_mutex);
 
-    /* Wait for thread to complete */
-    pthread_join(t->thread, NULL);
+    /* Wait for thread to complete, running queued tasks meanwhile so a
+       task waiting on one it spawned can't hold up the pool */
+    pool_wait(&t->pending);
 
     /* Get the result */
     lval* result = t->result;
 
     /* Clean up */
-    lenv_del(t->env);
+    lenv_snapshot_del(t->env);
     free(t);
 
     pthread_mutex_lock(&thread_mutex);
     thread_pool[thread_id] = NULL;
+    free_ids[free_count++] = thread_id;
     pthread_mutex_unlock(&thread_mutex);
 
     return result;
@@ -198,6 +305,10 @@ lval* builtin_wait(lenv* e, lval* a) {
 
 int counter;
 int debug;
+/* set by (gc), the collection runs at the next safe point */
+int gc_requested = 0;
+/* run compiled lambda bodies in the VM, debug turns this off to trace them */
+int vm_enabled = 1;
 void count_inc(int ltype) {
     counter++;
     if (debug == 1) {
@@ -238,6 +349,24 @@ static int bracket_balance(const char* input) {
 }
 
 #ifndef LISPY_TEST
+/* the reader only says where it gave up, mpc also says what it expected
+   there, so on a syntax error the source is parsed again for the message */
+static char* parse_error(const char* name, const char* src, lval* err) {
+    mpc_result_t r;
+    char* msg;
+    if (mpc_parse(name, src, Lispy, &r)) {
+        // mpc read it after all, so go with what the reader said
+        mpc_ast_delete(r.output);
+        msg = malloc(strlen(err->str) + 2);
+        sprintf(msg, "%s\n", err->str);
+    } else {
+        msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+    }
+    lval_del(err);
+    return msg;
+}
+
 int main(int argc, char **argv) {
     counter = 0;
     debug = 0;
@@ -271,7 +400,19 @@ int main(int argc, char **argv) {
     lenv* e = lenv_new();
     lenv_add_builtins(e);
     
-    if (argc == 1) {
+    /* --image starts from a saved env rather than a bare one */
+    int first = 1;
+    if (argc >= 3 && strcmp(argv[1], "--image") == 0) {
+        lval* x = lenv_restore(e, argv[2]);
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
+            return 1;
+        }
+        lval_del(x);
+        first = 3;
+    }
+
+    if (argc == first) {
         /* Print Version and Exit Information */
         puts("Lispy Version 0.0.0.0.1");
         puts("Press Ctrl+c to Exit\n");
@@ -326,7 +467,7 @@ int main(int argc, char **argv) {
             }
             if (strcmp(input, "builtins") == 0) {
                 printf("%d builtins:\n", e->count);
-                hash_traverse(e->syms, lenv_hash_print_keys, NULL);
+                symtab_traverse(&e->syms, lenv_hash_print_keys, NULL);
                 printf("\n");
                 free(input);
                 continue;
@@ -340,20 +481,28 @@ int main(int argc, char **argv) {
             }
 
             /* Attempt to Parse the user Input */
-            mpc_result_t r;
+            lval* err = NULL;
+            lval* z = read_forms("<lispy>", input, strlen(input), &err);
 
-            if (mpc_parse("<lispy>", input, Lispy, &r)) {
-                lval* z = lval_read(r.output);
+            if (z) {
                 lval* x = lval_eval(e, z);
                 if (!(x->type == LVAL_SEXPR && x->count == 0)) {
                     lval_println(x);
                 }
                 lval_del(x);
 
+                /* between inputs nothing but e holds values */
+                if (gc_requested) {
+                    gc_requested = 0;
+                    int n = lval_gc(e);
+                    if (debug == 1) { printf("gc: freed %d values\n", n); }
+                }
+
             } else {
                 /* Otherwise Print the Error */
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                char* msg = parse_error("<lispy>", input, err);
+                fputs(msg, stdout);
+                free(msg);
             }
             /* Free retrived input */
             free(input);
@@ -361,17 +510,24 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (argc >= 2) {
-        for (int i = 1; i < argc; i++) {
+    if (argc > first) {
+        /* --compile writes an image of each file rather than running it */
+        int compile = strcmp(argv[first], "--compile") == 0;
+        for (int i = first + compile; i < argc; i++) {
             // make an expr with a string containing the file name to load
             lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
             // load it with builtin load
-            lval* x = builtin_load(e, args);
+            lval* x = compile ? builtin_compile(e, args) : builtin_load(e, args);
             // duplicative?
             if (x->type == LVAL_ERR) { lval_println(x); }
             lval_del(x);
 
+            if (gc_requested) {
+                gc_requested = 0;
+                lval_gc(e);
+            }
+
         }
     }
 
@@ -382,18 +538,31 @@ int main(int argc, char **argv) {
 }
 #endif /* LISPY_TEST */
 
+/* whether the dict *arg binds key to v, clearing *arg if not */
+static int dict_has_item(lval* key, lval* v, void* arg) {
+    lval** d = arg;
+    lval* w = ltable_get(&(*d)->table, key, lval_hash(key));
+    lval* r = w ? lval_eq(v, w) : lval_bool(0);
+    int same = (int) r->num;
+    lval_del(r);
+    if (!same) { *d = NULL; }
+    return same;
+}
+
 lval* lval_eq(lval* x, lval* y) {
     if (x->type != y->type) { return lval_bool(0); }
 
     switch (x->type) {
+        case LVAL_LONG:
+            return lval_bool((x->inum == y->inum)); break;
         case LVAL_BOOL:
-        case LVAL_LONG: 
         case LVAL_FLOAT:
             return lval_bool((x->num == y->num)); break;
-        /* LVAL_STR, LVAL_ERR, LVAL_SYM all contain a string */
+        /* LVAL_STR and LVAL_ERR contain a string */
         case LVAL_STR:
-        case LVAL_ERR:
-        case LVAL_SYM: return lval_bool((strcmp(x->str, y->str) == 0)); break;
+        case LVAL_ERR: return lval_bool((strcmp(x->str, y->str) == 0)); break;
+        /* interned, so equal symbols are the same string */
+        case LVAL_SYM: return lval_bool(x->str == y->str); break;
         case LVAL_FUN:
            if (x->builtin) {
                return lval_bool((x->builtin == y->builtin));
@@ -404,11 +573,12 @@ lval* lval_eq(lval* x, lval* y) {
         case LVAL_QEXPR:
         case LVAL_SEXPR:
            if (x->count != y->count) { return lval_bool(0); }
-           // I am not confident I made this clearer :P
-           for (lval* u = list_start(x->cell), * v = list_start(y->cell);
-                list_end(x->cell) || list_end(y->cell);
-                list_iter(x->cell), list_iter(y->cell)) {
-               if (lval_eq(u, v)->num == 0) { return lval_bool(0); }
+           /* index both lists directly, x and y may be the same shared list */
+           for (int i = 0; i < x->count; i++) {
+               lval* r = lval_eq(list_index(x->cell, i), list_index(y->cell, i));
+               int same = (int) r->num;
+               lval_del(r);
+               if (!same) { return lval_bool(0); }
            }
            return lval_bool(1);
            break;
@@ -420,25 +590,53 @@ lval* lval_eq(lval* x, lval* y) {
         case LVAL_FRAC:
            return lval_bool(x->numer == y->numer && x->denom == y->denom);
            break;
+        case LVAL_DICT:
+        case LVAL_SET:
+           if (x->table.count != y->table.count) { return lval_bool(0); }
+           ltable_traverse(&x->table, dict_has_item, &y);
+           return lval_bool(y != NULL);
+           break;
+        case LVAL_VEC:
+           if (x->vec.len != y->vec.len) { return lval_bool(0); }
+           for (int i = 0; i < x->vec.len; i++) {
+               lval* r = lval_eq(lvec_get(&x->vec, i), lvec_get(&y->vec, i));
+               int same = (int) r->num;
+               lval_del(r);
+               if (!same) { return lval_bool(0); }
+           }
+           return lval_bool(1);
+           break;
     }
     return lval_bool(0);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    lval* r;
-    if (strcmp(op, "eq") == 0) { r = lval_eq((lval*)list_index(a->cell, 0), (lval*)list_index(a->cell, 1)); }
-    if (strcmp(op, "ne") == 0) { r = bool_negate_val(lval_eq((lval*)list_index(a->cell, 0), (lval*)list_index(a->cell, 1))); }
+lval* builtin_cmp(lenv* e, lval* a, int op) {
+    LASSERT_NUM(op == LOP_EQ ? "eq" : "ne", a, 2);
+    lval* r = lval_eq((lval*)list_index(a->cell, 0), (lval*)list_index(a->cell, 1));
+    if (op == LOP_NE) { r = bool_negate_val(r); }
     lval_del(a);
     return r;
 }
 
 
+/* lvals come from the slab's pool, where the collector can find them.
+   this is also where they are counted */
+static lval* lval_alloc(int type) {
+    lval* v = slab_pool_alloc(sizeof(lval));
+    v->type = type;
+    v->refs = 1;
+    count_inc(type);
+    return v;
+}
+
+static void lval_free(lval* v) {
+    count_dec(v->type);
+    slab_pool_free(v, sizeof(lval));
+}
+
 /* Create a new error type lval */
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
-    count_inc(v->type);
+    lval* v = lval_alloc(LVAL_ERR);
 
     /* create a va list and initialize it */
     va_list va;
@@ -460,46 +658,101 @@ lval* lval_err(char* fmt, ...) {
 }
 
 lval* lval_builtin(lbuiltin func, char* doc) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_alloc(LVAL_FUN);
     v->builtin = func;
+    v->code = NULL;
     v->doc = doc ? strdup(doc) : NULL;
-    count_inc(v->type);
     return v;
 }
 
 /* construct a pointer to a new symbol lval */
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->str = strdup(s);
-    count_inc(v->type);
+    lval* v = lval_alloc(LVAL_SYM);
+    v->str = intern(s, &v->hash);
+    return v;
+}
+
+/* the same for the len bytes at s, which need not end in a NUL */
+lval* lval_symn(const char* s, size_t len) {
+    lval* v = lval_alloc(LVAL_SYM);
+    v->str = internn(s, len, &v->hash);
     return v;
 }
 
 /* pointer to a new empty sexpr lval */
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_alloc(LVAL_SEXPR);
     v->count = 0;
     v->cell = list_init();// NULL;
-    count_inc(v->type);
     return v;
 }
 
 /* pointer to a new empty qexpr lval */
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_alloc(LVAL_QEXPR);
     v->count = 0;
     v->cell = list_init(); //NULL;
-    count_inc(v->type);
     return v;
 }
 
-/* delete lval pointer */
+/* values that are never freed: the booleans, the empty S- and
+   Q-expressions and small integers. constructors hand these out instead of
+   allocating, and their reference counts are never touched. refs is
+   left at 2 so lval_unshare copies them before any mutation */
+#define SMALL_INT_MIN -128
+#define SMALL_INT_MAX 1023
+enum { IMM_FALSE, IMM_TRUE, IMM_NIL, IMM_EMPTY, IMM_INTS,
+       IMM_COUNT = IMM_INTS + SMALL_INT_MAX - SMALL_INT_MIN + 1 };
+static lval immortals[IMM_COUNT];
+
+static int is_immortal(lval* v) {
+    return v >= immortals && v < immortals + IMM_COUNT;
+}
+
+__attribute__((constructor))
+static void immortals_init(void) {
+    for (int i = 0; i < IMM_COUNT; i++) { immortals[i].refs = 2; }
+    immortals[IMM_FALSE].type = LVAL_BOOL;
+    immortals[IMM_FALSE].num = 0;
+    immortals[IMM_TRUE].type = LVAL_BOOL;
+    immortals[IMM_TRUE].num = 1;
+    immortals[IMM_NIL].type = LVAL_SEXPR;
+    immortals[IMM_NIL].count = 0;
+    immortals[IMM_NIL].cell = list_init();
+    immortals[IMM_EMPTY].type = LVAL_QEXPR;
+    immortals[IMM_EMPTY].count = 0;
+    immortals[IMM_EMPTY].cell = list_init();
+    for (int i = IMM_INTS; i < IMM_COUNT; i++) {
+        immortals[i].type = LVAL_LONG;
+        immortals[i].inum = SMALL_INT_MIN + (i - IMM_INTS);
+    }
+}
+
+/* the empty S-expression, for builtins that have nothing to return */
+lval* lval_nil(void) {
+    return &immortals[IMM_NIL];
+}
+
+/* take another reference to a value, sharing its structure */
+lval* lval_retain(lval* v) {
+    if (is_immortal(v)) { return v; }
+    __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    return v;
+}
+
+/* return a version of v that is safe to mutate. if v is shared
+   it is released and a copy with shared children is returned */
+lval* lval_unshare(lval* v) {
+    if (__atomic_load_n(&v->refs, __ATOMIC_ACQUIRE) == 1) { return v; }
+    lval* x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
+/* release a reference to an lval, freeing it once nobody owns it */
 void lval_del(lval* v) {
-    count_dec(v->type);
+    if (is_immortal(v)) { return; }
+    if (__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
     switch (v->type) {
         case LVAL_FLOAT: break;
         case LVAL_BOOL: break;
@@ -510,14 +763,16 @@ void lval_del(lval* v) {
                    lenv_del(v->env);
                    lval_del(v->formals);
                    lval_del(v->body);
+                   lcode_release(v->code);
             }
             if (v->doc) { free(v->doc); }
             break;
     
         /* free string data */
         case LVAL_STR:
-        case LVAL_ERR:
-        case LVAL_SYM: free(v->str); break;
+        case LVAL_ERR: free(v->str); break;
+        /* symbol names are interned and never freed */
+        case LVAL_SYM: break;
 
         /* for sexpr delete all elements inside */
         case LVAL_QEXPR:
@@ -528,7 +783,6 @@ void lval_del(lval* v) {
                 lval_del(z);
             }
             /* also free the memory allocated to contain the pointers */
-            // TODO: should instead just create some way to delete the list
             list_destroy(v->cell);
             break;
 
@@ -538,65 +792,293 @@ void lval_del(lval* v) {
             free(v->type_name);
             lval_del(v->fields);
             break;
+
+        case LVAL_DICT:
+        case LVAL_SET: ltable_free(&v->table); break;
+        case LVAL_VEC: lvec_free(&v->vec); break;
     }
-    free(v);
+    lval_free(v);
 }
 
 // ok, I think I get it, these will pass an expression (+ 3 3) -> lval (3 3)
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
-lval* builtin_eq(lenv* e, lval* a)  { return builtin_cmp(e, a, "eq"); }
-lval* builtin_ne(lenv* e, lval* a)  { return builtin_cmp(e, a, "ne"); }
-lval* builtin_lt(lenv* e, lval* a)  { return builtin_op(e, a, "lt"); }
-lval* builtin_gt(lenv* e, lval* a)  { return builtin_op(e, a, "gt"); }
-lval* builtin_le(lenv* e, lval* a)  { return builtin_op(e, a, "le"); }
-lval* builtin_ge(lenv* e, lval* a)  { return builtin_op(e, a, "ge"); }
+lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, LOP_ADD); }
+lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, LOP_SUB); }
+lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, LOP_MUL); }
+lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, LOP_DIV); }
+lval* builtin_eq(lenv* e, lval* a)  { return builtin_cmp(e, a, LOP_EQ); }
+lval* builtin_ne(lenv* e, lval* a)  { return builtin_cmp(e, a, LOP_NE); }
+lval* builtin_lt(lenv* e, lval* a)  { return builtin_op(e, a, LOP_LT); }
+lval* builtin_gt(lenv* e, lval* a)  { return builtin_op(e, a, LOP_GT); }
+lval* builtin_le(lenv* e, lval* a)  { return builtin_op(e, a, LOP_LE); }
+lval* builtin_ge(lenv* e, lval* a)  { return builtin_op(e, a, LOP_GE); }
 
 // string operations
-lval* builtin_str(lenv* e, lval* a) { return builtin_str_op(e, a, "str"); }
+lval* builtin_str(lenv* e, lval* a) { return builtin_str_op(e, a); }
 
 // unary operators
 lval* builtin_not(lenv* e, lval* a) { return bool_negate_expr(a);}
 
-lval* builtin_load(lenv* e, lval* a) {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
+/* load reads this much of a file at a time, more if one form is longer */
+#define LOAD_CHUNK 65536
 
-    // parse file given by string name
-    mpc_result_t r;
-    if (mpc_parse_contents((((lval*)list_index(a->cell, 0)))->str, Lispy, &r)) {
+/* let go of the mapped pages a reader has passed every so often, they
+   won't be looked at again */
+static void drop_passed(const char** passed, const char* p) {
+    if (p - *passed < LOAD_CHUNK * 16) { return; }
+    size_t n = (p - *passed) & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    madvise((void*)*passed, n, MADV_DONTNEED);
+    *passed += n;
+}
 
-        // read contents
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+/* Evaluate each form of a file as soon as it has been read, letting it
+   go before the next. The reader runs over src, a mapping of the file,
+   or if that is NULL over pieces of f read into a buffer as it goes.
+   Returns a syntax error or NULL */
+static lval* load_forms(lenv* e, const char* path, const char* src, size_t len, FILE* f) {
+    size_t cap = LOAD_CHUNK;
+    char* buf = NULL;
+    const char* passed = src;
+    reader r;
+    if (src) {
+        reader_init(&r, path, src, len);
+    } else {
+        buf = malloc(cap);
+        reader_init(&r, path, "", 0);
+        r.more = 1;
+    }
 
-        // evaluate each expression
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
+    for (;;) {
+        lval* x = reader_next(&r);
+        if (x) {
+            x = lval_eval(e, x);
             // if eval leads to an error, print it
             if (x->type == LVAL_ERR) { lval_println(x); }
             lval_del(x);
+            if (src) { drop_passed(&passed, r.p); }
+            continue;
+        }
+        if (r.err || !r.more) { break; }
+
+        /* the buffer ran out, keep what is left of it and read on */
+        size_t keep = r.end - r.p;
+        memmove(buf, r.p, keep);
+        if (keep == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        size_t n = fread(buf + keep, 1, cap - keep, f);
+        reader_feed(&r, buf, keep + n, n > 0);
+    }
+    free(buf);
+    return r.err;
+}
+
+/* map all of a regular file for reading, NULL if it can't be */
+static char* map_file(FILE* f, size_t* len) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) { return NULL; }
+    *len = st.st_size;
+    // there is nothing to map of an empty file
+    if (*len == 0) { return ""; }
+    char* map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    return map != MAP_FAILED ? map : NULL;
+}
+
+static void unmap_file(char* map, size_t len) {
+    if (len) { munmap(map, len); }
+}
+
+/* Evaluate the forms cached in the image beside path, if there is one
+   made from src. Returns 0, having done nothing, if there isn't */
+static int load_image(lenv* e, const char* path, const char* src, size_t len, lval** err) {
+    char* img_path = image_path(path);
+    FILE* f = fopen(img_path, "rb");
+    free(img_path);
+    if (f == NULL) { return 0; }
+    size_t size;
+    char* map = map_file(f, &size);
+    fclose(f);
+    if (map == NULL) { return 0; }
+
+    /* the length is a cheap test before hashing the whole source */
+    image_in in;
+    const char* passed = src;
+    int fresh = image_in_open(&in, map, size, IMAGE_FORMS, len);
+    if (fresh) {
+        uint64_t h = IMAGE_HASH_INIT;
+        for (size_t i = 0; i < len; i += LOAD_CHUNK) {
+            size_t n = len - i < LOAD_CHUNK ? len - i : LOAD_CHUNK;
+            h = image_hash(h, src + i, n);
+            drop_passed(&passed, src + i + n);
         }
+        fresh = h == in.hash;
+    }
+    if (!fresh) {
+        image_in_close(&in);
+        unmap_file(map, size);
+        return 0;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    passed = map;
+
+    lval* x;
+    while ((x = image_next(&in))) {
+        x = lval_eval(e, x);
+        // if eval leads to an error, print it
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+        drop_passed(&passed, (const char*)in.p);
+    }
+    *err = in.err ? lval_err("%s: damaged image, %s", path, in.err) : NULL;
+    image_in_close(&in);
+    unmap_file(map, size);
+    return 1;
+}
 
-        // delete expressions and arguments
-        lval_del(expr);
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    char* path = ((lval*)list_index(a->cell, 0))->str;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        // worded as mpc words it
+        lval* err = lval_err("Could not load file error: %s\n", path);
         lval_del(a);
+        return err;
+    }
 
-        return lval_sexpr();
+    /* a regular file is mapped and read in place, the kernel pages it
+       in ahead of the reader and can drop what it has passed. if it has
+       an up to date image that is read instead. anything else, or a file
+       that won't map, is read through a buffer */
+    lval* err;
+    size_t len;
+    char* map = map_file(f, &len);
+    if (map) {
+        madvise(map, len, MADV_SEQUENTIAL);
+        if (!load_image(e, path, map, len, &err)) {
+            err = load_forms(e, path, map, len, NULL);
+        }
+        unmap_file(map, len);
     } else {
-        // get parse error as string
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+        err = load_forms(e, path, NULL, 0, f);
+    }
+    fclose(f);
 
-        // create new error message
-        lval* err = lval_err("Could not load file %s", err_msg);
-        free(err_msg);
+    if (err) {
+        /* forms before the error have been evaluated by now. mpc would
+           have to take in the whole file to say more than the reader */
+        lval* x = lval_err("Could not load file %s", err->str);
+        lval_del(err);
         lval_del(a);
+        return x;
+    }
+
+    lval_del(a);
+    return lval_nil();
+}
 
+/* Read a file and cache its forms in an image beside it, which load
+   uses until the file changes: (compile "file.lspy") -> "file.lspyc" */
+lval* builtin_compile(lenv* e, lval* a) {
+    LASSERT_NUM("compile", a, 1);
+    LASSERT_TYPE("compile", a, 0, LVAL_STR);
+
+    char* path = ((lval*)list_index(a->cell, 0))->str;
+    FILE* f = fopen(path, "rb");
+    size_t len;
+    char* src = f ? map_file(f, &len) : NULL;
+    if (src == NULL) {
+        lval* err = lval_err("Could not compile file %s", path);
+        if (f) { fclose(f); }
+        lval_del(a);
         return err;
     }
+
+    /* written beside the image and renamed over it once complete, so
+       load never sees half an image */
+    char* img_path = image_path(path);
+    char* tmp_path = malloc(strlen(img_path) + 5);
+    sprintf(tmp_path, "%s.tmp", img_path);
+
+    lval* result = NULL;
+    image_out out;
+    if (image_out_open(&out, tmp_path, IMAGE_FORMS, image_hash(IMAGE_HASH_INIT, src, len), len)) {
+        reader r;
+        reader_init(&r, path, src, len);
+        lval* x;
+        while ((x = reader_next(&r))) {
+            image_write(&out, x);
+            lval_del(x);
+        }
+        int written = image_out_close(&out);
+        if (r.err) {
+            result = lval_err("Could not compile file %s", r.err->str);
+            lval_del(r.err);
+        } else if (!written || rename(tmp_path, img_path) != 0) {
+            result = lval_err("Could not write image %s", img_path);
+        }
+        if (result) { remove(tmp_path); }
+    } else {
+        result = lval_err("Could not write image %s", img_path);
+    }
+    if (result == NULL) { result = lval_str(img_path); }
+
+    free(tmp_path);
+    free(img_path);
+    unmap_file(src, len);
+    fclose(f);
+    lval_del(a);
+    return result;
+}
+
+/* Write the bindings of the global env to an image, which the
+   interpreter can start up with: (save-image "env.img") then
+   lispy --image env.img */
+lval* builtin_save_image(lenv* e, lval* a) {
+    LASSERT_NUM("save-image", a, 1);
+    LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+
+    char* path = ((lval*)list_index(a->cell, 0))->str;
+    char* tmp_path = malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    while (e->par) { e = e->par; }
+
+    image_out out;
+    int ok = image_out_open(&out, tmp_path, IMAGE_ENV, 0, 0);
+    if (ok) {
+        image_write_env(&out, e);
+        ok = image_out_close(&out) && rename(tmp_path, path) == 0;
+        if (!ok) { remove(tmp_path); }
+    }
+    lval* result = ok ? lval_nil() : lval_err("Could not write image %s", path);
+    free(tmp_path);
+    lval_del(a);
+    return result;
+}
+
+/* Bind everything in an image written by save-image into e. Returns
+   an error if it can't, possibly having bound some of it */
+lval* lenv_restore(lenv* e, const char* path) {
+    FILE* f = fopen(path, "rb");
+    size_t size;
+    char* map = f ? map_file(f, &size) : NULL;
+    if (f) { fclose(f); }
+    if (map == NULL) { return lval_err("Could not load image %s", path); }
+
+    image_in in;
+    lval* result;
+    if (!image_in_open(&in, map, size, IMAGE_ENV, 0) && in.err == NULL) {
+        result = lval_err("Could not load image %s: not an image of an env", path);
+    } else if (in.err || !image_read_env(&in, e)) {
+        result = lval_err("Could not load image %s: damaged image, %s", path, in.err);
+    } else {
+        result = lval_nil();
+    }
+    image_in_close(&in);
+    unmap_file(map, size);
+    return result;
 }
 
 lval* builtin_print(lenv* e, lval* a) {
@@ -616,7 +1098,7 @@ lval* builtin_print(lenv* e, lval* a) {
 
     // putchar('\n');
     lval_del(a);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 lval* builtin_error(lenv* e, lval* a) {
@@ -663,11 +1145,11 @@ lval* builtin_help(lenv* e, lval* a) {
         while (global->par) { global = global->par; }
 
         /* Traverse all symbols and print help for builtins */
-        hash_traverse(global->syms, print_builtin_help, NULL);
+        symtab_traverse(&global->syms, print_builtin_help, NULL);
 
         printf("\nUse (help name) for detailed help on a specific builtin.\n");
         lval_del(a);
-        return lval_sexpr();
+        return lval_nil();
     } else if (a->count == 1) {
         /* One argument - show detailed help for that builtin */
         lval* arg = (lval*)list_index(a->cell, 0);
@@ -709,7 +1191,7 @@ lval* builtin_help(lenv* e, lval* a) {
 
         lval_del(val);
         lval_del(a);
-        return lval_sexpr();
+        return lval_nil();
     } else {
         lval* err = lval_err("Function 'help' passed too many arguments. Got %d, expected 0 or 1.", a->count);
         lval_del(a);
@@ -819,7 +1301,7 @@ lval* lval_eval_debug(lenv* e, lval* v, int depth) {
     }
     /* Evaluate S-expressions */
     if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr_debug(e, v, depth);
+        return lval_eval_sexpr_debug(e, lval_unshare(v), depth);
     }
     /* all other lval types remain the same */
     debug_indent(depth);
@@ -834,16 +1316,22 @@ lval* builtin_debug(lenv* e, lval* a) {
     LASSERT_NUM("debug", a, 1);
     LASSERT_TYPE("debug", a, 0, LVAL_QEXPR);
 
-    lval* x = lval_pop(a, 0);
+    lval* x = lval_unshare(lval_pop(a, 0));
     lval_del(a);
 
     /* Convert Q-expression to S-expression for evaluation */
     x->type = LVAL_SEXPR;
 
+    /* lambdas called from here are tree walked rather than run in the VM */
+    int vm_was_enabled = vm_enabled;
+    vm_enabled = 0;
+
     printf("\n=== DEBUG EVAL ===\n");
     lval* result = lval_eval_debug(e, x, 0);
     printf("=== END DEBUG ===\n\n");
 
+    vm_enabled = vm_was_enabled;
+
     return result;
 }
 
@@ -851,76 +1339,99 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     // if builtin, call it
     if (f->builtin) { return f->builtin(e, a); }
 
+    lval* g = lval_bind(e, f, a);
+    // an error, or a partially applied function
+    if (g->type == LVAL_ERR || g->formals->count > 0) { return g; }
+
+    g->env->par = e;
+
+    if (vm_enabled && g->code) { return lcode_run(g); }
+
+    // the body is shared, evaluation unshares only what it rewrites
+    lval* result = builtin_eval(g->env, lval_add(lval_sexpr(), lval_retain(g->body)));
+    lval_del(g);
+    return result;
+}
+
+/* bind the arguments a to the formals of lambda f. returns a new
+   function value holding the bindings in its env, which still has
+   formals left when f was only partially applied. consumes a */
+lval* lval_bind(lenv* e, lval* f, lval* a) {
+    // binding fills env, so work on our own copy with a private env.
+    // formals may be shared, so it is only read here
+    f = lval_unshare(lval_retain(f));
+    f->env = lenv_unshare(f->env);
+
     // record argument counts
     int given = a->count;
     int total = f->formals->count;
+    // formals bound so far
+    int i = 0;
 
     // while args still remain to be processed
     while (a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
+        if (i == total) {
+            lval_del(a); lval_del(f);
             return lval_err("Function passed too many arguments. Got %d, expected %d", given, total);
         }
 
-        // pop the first symbol from formals
-        lval* sym = lval_pop(f->formals, 0);
+        // take the next symbol from formals
+        lval* sym = list_index(f->formals->cell, i++);
         if (strcmp(sym->str, "&") == 0) {
             // ensure & is followed by another symbol
-            if (f->formals->count != 1) {
-                lval_del(a);
+            if (total - i != 1) {
+                lval_del(a); lval_del(f);
                 return lval_err("Function format invalid. Symbol '&' not followed by a single symbol.");
             }
 
             // next formal should be bound to remaining arguments
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+            lval* nsym = list_index(f->formals->cell, i++);
+            lval* rest = builtin_list(e, a);
+            lenv_put(f->env, nsym, rest);
+            a = rest;
             break;
         }
 
         lval* val = lval_pop(a, 0);
 
-        // bind a copy into the function's env
+        // bind it into the function's env
         lenv_put(f->env, sym, val);
-
-        //delete sym and val
-        lval_del(sym);
         lval_del(val);
     }
 
     lval_del(a);
 
-    if (f->formals->count > 0 && (strcmp(((lval*)list_index(f->formals->cell, 0))->str, "&") == 0)) {
+    if (i < total && (strcmp(((lval*)list_index(f->formals->cell, i))->str, "&") == 0)) {
         // check to ensure that & is not passed invalidly
-        if (f->formals->count != 2) {
+        if (total - i != 2) {
+            lval_del(f);
             return lval_err("Function format invalid. Symbol '&' not followed by a single symbol.");
         }
-        lval_del(lval_pop(f->formals, 0));
 
-        lval* sym = lval_pop(f->formals, 0);
+        lval* sym = list_index(f->formals->cell, i + 1);
         lval* val = lval_qexpr();
 
         // bind to environment and delete
         lenv_put(f->env, sym, val);
-        lval_del(sym);
         lval_del(val);
+        i += 2;
     }
 
-    if (f->formals->count == 0) {
-        f->env->par = e;
-
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        return lval_copy(f);
+    // keep only the formals left unbound
+    if (i == total) {
+        lval_del(f->formals);
+        f->formals = &immortals[IMM_EMPTY];
+    } else if (i > 0) {
+        f->formals = lval_unshare(f->formals);
+        while (i--) { lval_del(lval_pop(f->formals, 0)); }
     }
+
+    return f;
 }
 
 lval* lval_add(lval* v, lval* x) {
     v->count++;
     list_push(v->cell, x);
-    // v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    // v->cell[v->count-1] = x;
     return v;
 }
 
@@ -953,37 +1464,41 @@ lval* lval_read(mpc_ast_t* t) {
     return x;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-
-    /* Special form: help - don't evaluate arguments */
-    if (v->count >= 1) {
-        lval* first = (lval*)list_index(v->cell, 0);
-        if (first->type == LVAL_SYM && strcmp(first->str, "help") == 0) {
-            /* Pop off the 'help' symbol and look it up */
-            lval* sym = lval_pop(v, 0);
-            lval* f = lenv_get(e, sym);
-            lval_del(sym);
-
-            if (f->type == LVAL_ERR) {
-                lval_del(v);
-                return f;
-            }
+static symtab_entry* lenv_slot(lenv* e, char* key);
 
-            /* Call help with unevaluated arguments */
-            lval* result = lval_call(e, f, v);
-            lval_del(f);
-            return result;
-        }
+/* copy a binding into e unless e already binds the key */
+static void lenv_absorb_kv(lenv* e, symtab_entry* x) {
+    if (x->key == NULL || x->val == NULL) { return; }
+    symtab_entry* slot = lenv_slot(e, x->key);
+    if (slot && slot->val) { return; }
+    if (symtab_get(&e->syms, x->key, x->hash)) { return; }
+    if (slot) {
+        slot->val = lval_retain(x->val);
+    } else {
+        intern_mark_local(x->key);
+        symtab_put(&e->syms, x->key, x->hash, lval_retain(x->val));
     }
+    e->count++;
+}
 
-    /* Evaluate the children */
-    list_start(v->cell);
-    while (list_end(v->cell)) {
-        lval* l = list_curr(v->cell);
-        list_replace_curr(v->cell, lval_eval(e, l));
-        list_iter(v->cell);
+/* a tail call leaves the caller's frame outer for good, but scope is
+   dynamic so the callee's frame inner may still look up its bindings.
+   pull the ones inner does not rebind into it, so outer can be dropped
+   without changing what any lookup finds */
+void lenv_absorb(lenv* inner, lenv* outer) {
+    for (int i = 0; i < outer->nslots; i++) {
+        lenv_absorb_kv(inner, &outer->slots[i]);
     }
+    for (int i = 0; i < outer->syms.cap; i++) {
+        lenv_absorb_kv(inner, &outer->syms.entries[i]);
+    }
+    inner->par = outer->par;
+}
 
+/* once the cells of v are evaluated, find its value if that needs no
+   call: the first error, the empty expression, or a lone non-function.
+   returns NULL when the head of v is a function to call on the rest */
+lval* lval_sexpr_value(lval* v) {
     /* Error checking */
     int err_index = 0;
     list_start(v->cell);
@@ -1000,26 +1515,148 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     if (v->count == 0) { return v; }
 
     /* Single expression - if not a function, just return it */
-    if (v->count == 1) {
-        lval* first = (lval*)list_index(v->cell, 0);
-        if (first->type != LVAL_FUN) {
-            return lval_take(v, 0);
-        }
-        /* Otherwise, fall through to call it with no args */
+    lval* first = (lval*)list_index(v->cell, 0);
+    if (v->count == 1 && first->type != LVAL_FUN) {
+        return lval_take(v, 0);
     }
 
     /* Ensure first element is a function */
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err("S-Expression starts with incorrect type. Got %s, expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f); lval_del(v);
+    if (first->type != LVAL_FUN) {
+        lval* err = lval_err("S-Expression starts with incorrect type. Got %s, expected %s.", ltype_name(first->type), ltype_name(LVAL_FUN));
+        lval_del(v);
         return err;
     }
+    return NULL;
+}
 
-    /* Call builtin with operator */
-    lval* result = lval_call(e, f, v);
-    // should v be deleted too?
-    lval_del(f);
+/* evaluate the children of v from index start, stopping short of end */
+static void lval_eval_cells(lenv* e, lval* v, int start, int end) {
+    for (int i = start; i < end; i++) {
+        list_replace(v->cell, i, lval_eval(e, list_index(v->cell, i)));
+    }
+}
+
+/* Evaluate an S-expression. This is a trampoline: the taken branch of
+   if, the last form of do, eval and the body of a lambda are all in
+   tail position, so instead of recursing they replace v (and e) and
+   loop, keeping the C stack flat for recursive Lispy functions.
+
+   frame is the bound function whose environment is currently being
+   evaluated in, released once the final value is known. */
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    lval* frame = NULL;
+    lval* result = NULL;
+
+    while (result == NULL) {
+        /* a tail position may hold any value, not just an S-expression */
+        if (v->type == LVAL_SYM) {
+            result = lenv_get(e, v);
+            lval_del(v);
+            break;
+        }
+        if (v->type != LVAL_SEXPR) {
+            result = v;
+            break;
+        }
+        v = lval_unshare(v);
+
+        /* Special form: help - don't evaluate arguments */
+        if (v->count >= 1) {
+            lval* first = (lval*)list_index(v->cell, 0);
+            if (first->type == LVAL_SYM && strcmp(first->str, "help") == 0) {
+                /* Pop off the 'help' symbol and look it up */
+                lval* sym = lval_pop(v, 0);
+                lval* f = lenv_get(e, sym);
+                lval_del(sym);
+
+                if (f->type == LVAL_ERR) {
+                    lval_del(v);
+                    result = f;
+                    break;
+                }
+
+                /* Call help with unevaluated arguments */
+                result = lval_call(e, f, v);
+                lval_del(f);
+                break;
+            }
+        }
+
+        /* Evaluate the head first, do only evaluates its last form
+           once it knows everything before it succeeded */
+        lval_eval_cells(e, v, 0, v->count > 0 ? 1 : 0);
+        lval* head = list_index(v->cell, 0);
+        int is_do = v->count > 1 && head->type == LVAL_FUN && head->builtin == builtin_do;
+
+        /* Evaluate the children */
+        lval_eval_cells(e, v, 1, is_do ? v->count - 1 : v->count);
+
+        /* Values that need no call */
+        result = lval_sexpr_value(v);
+        if (result) { break; }
+
+        lval* f = lval_pop(v, 0);
+
+        /* do: the last form is the value, evaluate it in place */
+        if (is_do) {
+            lval_del(f);
+            v = lval_take(v, v->count - 1);
+            continue;
+        }
+
+        /* if: continue with the taken branch */
+        if (f->builtin == builtin_if) {
+            lval_del(f);
+            v = lval_if_branch(e, v);
+            if (v->type == LVAL_ERR) { result = v; }
+            continue;
+        }
+
+        /* eval: continue with the Q-expression as an S-expression */
+        if (f->builtin == builtin_eval && v->count == 1 &&
+            ((lval*)list_index(v->cell, 0))->type == LVAL_QEXPR) {
+            lval_del(f);
+            v = lval_unshare(lval_take(v, 0));
+            v->type = LVAL_SEXPR;
+            continue;
+        }
+
+        /* Call builtin with operator */
+        if (f->builtin) {
+            result = f->builtin(e, v);
+            lval_del(f);
+            break;
+        }
+
+        /* Lambda: bind the arguments and continue with its body */
+        lval* g = lval_bind(e, f, v);
+        lval_del(f);
+        if (g->type == LVAL_ERR || g->formals->count > 0) {
+            result = g;
+            break;
+        }
+
+        g->env->par = e;
+        if (frame) {
+            /* a tail call out of the frame we entered replaces it */
+            lenv_absorb(g->env, frame->env);
+            lval_del(frame);
+            frame = NULL;
+        }
+
+        /* compiled bodies run in the VM, which handles its own tail calls */
+        if (vm_enabled && g->code) {
+            result = lcode_run(g);
+            break;
+        }
+        frame = g;
+
+        e = g->env;
+        v = lval_unshare(lval_retain(g->body));
+        v->type = LVAL_SEXPR;
+    }
+
+    if (frame) { lval_del(frame); }
     return result;
 }
 
@@ -1029,7 +1666,7 @@ lval* lval_eval(lenv* e, lval* v) {
         lval_del(v);
         return x;
     }
-    /* Evaluate S-expressions */
+    /* Evaluate S-expressions, evaluation rewrites the cells in place */
     if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
     /* all other lval types remain the same */
     return v;
@@ -1039,15 +1676,11 @@ lval* lval_eval(lenv* e, lval* v) {
 lval* lval_pop(lval* v, int index) {
     /* find the item at i */
     lval* x = (lval*)list_index(v->cell, index);
-    list_remove(v->cell, index);
 
-    /* shift the memory following the item at i over the top of it */
-    // memmove(&v->cell[index], &v->cell[index+1], sizeof(lval*) * (v->count-index-1));
+    /* popping the front is O(1), elsewhere shifts the tail over it */
+    list_remove(v->cell, index);
 
     v->count--;
-
-    /* reallocate the memory used */
-    // v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     return x;
 }
 
@@ -1057,7 +1690,7 @@ lval* lval_take(lval* v, int i) {
     return x;
 }
 
-lval* builtin_str_op(lenv* e, lval* a, char* op) {
+lval* builtin_str_op(lenv* e, lval* a) {
     // convert all arguments to strings
     // this is wrong - but for now I'll keep it
     // may not always want to convert arguments,
@@ -1065,6 +1698,7 @@ lval* builtin_str_op(lenv* e, lval* a, char* op) {
     // making an assumption that these operate
     // on an arbitrary number of variable
     // arguments that all must be strings
+    int len = 0;
     list_start(a->cell);
     while (list_end(a->cell)) {
         lval* v = list_curr(a->cell);
@@ -1074,28 +1708,84 @@ lval* builtin_str_op(lenv* e, lval* a, char* op) {
                 lval_del(a);
                 return z;
             }
-            list_replace_curr(a->cell, z);
+            if (z != v) {
+                list_replace_curr(a->cell, z);
+                lval_del(v);
+                v = z;
+            }
         }
+        len += strlen(v->str);
         list_iter(a->cell);
     }
-    lval* x = lval_pop(a, 0);
-
-    while (a->count > 0 && x->type != LVAL_ERR) {
-        lval* y = lval_pop(a, 0);
-        
-        // perform operation
-        if (strcmp(op, "str") == 0) {
-            x->str = realloc(x->str, strlen(x->str) + strlen(y->str) + 1);
-            strncat(x->str, y->str, strlen(y->str));
-        }
-        lval_del(y);
+    lval* x = lval_unshare(lval_pop(a, 0));
+
+    // size the result once, then copy each string in after the last
+    int at = strlen(x->str);
+    x->str = realloc(x->str, len + 1);
+    for (int i = 0; i < a->count; i++) {
+        lval* y = list_index(a->cell, i);
+        int n = strlen(y->str);
+        memcpy(x->str + at, y->str, n);
+        at += n;
     }
+    x->str[at] = '\0';
     lval_del(a);
 
     return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+/* a number as a double, whether it is stored as an integer or not */
+static double lval_as_double(lval* v) {
+    return v->type == LVAL_LONG ? (double)v->inum : v->num;
+}
+
+/* exact integer kernel for builtin_op. returns 0 if the result does not
+   fit in 64 bits, leaving the caller to redo it in floating point */
+static int builtin_op_long(lval* x, lval* a, int op, int64_t* out) {
+    int64_t acc = x->inum;
+    int n = a->count;
+    for (int i = 0; i < n; i++) {
+        int64_t y = ((lval*)list_index(a->cell, i))->inum;
+        switch (op) {
+            case LOP_ADD: if (__builtin_add_overflow(acc, y, &acc)) { return 0; } break;
+            case LOP_SUB: if (__builtin_sub_overflow(acc, y, &acc)) { return 0; } break;
+            case LOP_MUL: if (__builtin_mul_overflow(acc, y, &acc)) { return 0; } break;
+            /* comparisons chain on the boolean result, as they always have */
+            case LOP_LT:  acc = acc <  y; break;
+            case LOP_GT:  acc = acc >  y; break;
+            case LOP_LE:  acc = acc <= y; break;
+            case LOP_GE:  acc = acc >= y; break;
+        }
+    }
+    *out = acc;
+    return 1;
+}
+
+/* floating point kernel for builtin_op */
+static lval* builtin_op_double(lval* x, lval* a, int op) {
+    double acc = lval_as_double(x);
+    int n = a->count;
+    for (int i = 0; i < n; i++) {
+        double y = lval_as_double(list_index(a->cell, i));
+        switch (op) {
+            case LOP_ADD: acc += y; break;
+            case LOP_SUB: acc -= y; break;
+            case LOP_MUL: acc *= y; break;
+            case LOP_DIV:
+                if (y == 0) { return lval_err("Division by zero."); }
+                acc /= y;
+                break;
+            case LOP_LT:  acc = acc <  y; break;
+            case LOP_GT:  acc = acc >  y; break;
+            case LOP_LE:  acc = acc <= y; break;
+            case LOP_GE:  acc = acc >= y; break;
+        }
+    }
+    if (op >= LOP_LT) { return lval_bool(acc != 0); }
+    return lval_float(acc);
+}
+
+lval* builtin_op(lenv* e, lval* a, int op) {
     /* Ensure all args are numbers */
     int hasfloat = 0;
     list_start(a->cell);
@@ -1112,66 +1802,36 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
         list_iter(a->cell);
     }
 
-    /* Pop the first element */
+    /* Pop the first element, the rest are folded into it */
     lval* x = lval_pop(a, 0);
-    if (hasfloat == 1) {
-        // x is the result in the end, it's the only one that needs to be a float
-        x->type = LVAL_FLOAT;
-    }
 
-    /* if no args and sub then perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) { x->num = -x->num; }
-
-    /* while there are still elements remaining */
-
-    while (a->count > 0) {
-
-        /* pop the next element */
-        lval* y = lval_pop(a, 0);
-
-        /* perform operation */
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            x->type = LVAL_FLOAT;
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division by zero."); break;
-            } else {
-                x->num /= y->num;
-            }
-        }
-        
-        /* this isn't really necessary
-        if (x->num == (long) x->num) {
-            x->type = LVAL_LONG;
+    /* a single argument is returned as is, or negated by - */
+    if (a->count == 0) {
+        lval_del(a);
+        if (op != LOP_SUB) { return x; }
+        if (x->type == LVAL_FLOAT) {
+            lval* r = lval_float(-x->num);
+            lval_del(x);
+            return r;
         }
-        */ 
+        lval* r = x->inum == INT64_MIN ? lval_float(-(double)x->inum) : lval_long(-x->inum);
+        lval_del(x);
+        return r;
+    }
 
-        if (strcmp(op, "lt") == 0) {
-            x->num = (x->num < y->num);
-            x->type = LVAL_BOOL;
-        }
-        if (strcmp(op, "gt") == 0) {
-            x->num = (x->num > y->num);
-            x->type = LVAL_BOOL;
-        }
-        if (strcmp(op, "le") == 0) {
-            x->num = x->num <= y->num;
-            x->type = LVAL_BOOL;
-        }
-        if (strcmp(op, "ge") == 0) {
-            x->num = x->num >= y->num;
-            x->type = LVAL_BOOL;
-        }
-        /* delete element now finished with */
-        lval_del(y);
+    /* integers stay exact unless they overflow, division is always float */
+    lval* r = NULL;
+    int64_t acc;
+    if (!hasfloat && op != LOP_DIV && builtin_op_long(x, a, op, &acc)) {
+        r = op >= LOP_LT ? lval_bool(acc != 0) : lval_long(acc);
+    } else {
+        r = builtin_op_double(x, a, op);
     }
 
     /* delete input expression and return result */
+    lval_del(x);
     lval_del(a);
-    return x;
+    return r;
 }
 
 // it would be nice to be able to represent strings as lists to avoid
@@ -1198,18 +1858,25 @@ lval* builtin_int(lenv* e, lval* a) {
         case LVAL_LONG:
             return v;
         case LVAL_FLOAT: {
-            long result = (long)v->num;
+            // the cast is undefined for NaN, infinities and anything
+            // outside [-2^63, 2^63), which NaN fails too
+            if (!(v->num >= -9223372036854775808.0 && v->num < 9223372036854775808.0)) {
+                lval* err = lval_err("Cannot convert %g to integer, out of range", v->num);
+                lval_del(v);
+                return err;
+            }
+            int64_t result = (int64_t)v->num;
             lval_del(v);
             return lval_long(result);
         }
         case LVAL_BOOL: {
-            long result = (int)v->num;
+            int64_t result = (int)v->num;
             lval_del(v);
             return lval_long(result);
         }
         case LVAL_STR: {
             char* endptr;
-            long result = strtol(v->str, &endptr, 10);
+            int64_t result = strtoll(v->str, &endptr, 10);
             if (*endptr != '\0') {
                 lval* err = lval_err("Cannot convert string '%s' to integer", v->str);
                 lval_del(v);
@@ -1236,18 +1903,18 @@ lval* builtin_float_cast(lenv* e, lval* a) {
         case LVAL_FLOAT:
             return v;
         case LVAL_LONG: {
-            float result = v->num;
+            double result = (double)v->inum;
             lval_del(v);
             return lval_float(result);
         }
         case LVAL_BOOL: {
-            float result = v->num;
+            double result = v->num;
             lval_del(v);
             return lval_float(result);
         }
         case LVAL_STR: {
             char* endptr;
-            float result = strtof(v->str, &endptr);
+            double result = strtod(v->str, &endptr);
             if (*endptr != '\0') {
                 lval* err = lval_err("Cannot convert string '%s' to float", v->str);
                 lval_del(v);
@@ -1273,7 +1940,11 @@ lval* builtin_bool_cast(lenv* e, lval* a) {
     switch (v->type) {
         case LVAL_BOOL:
             return v;
-        case LVAL_LONG:
+        case LVAL_LONG: {
+            int result = (v->inum != 0);
+            lval_del(v);
+            return lval_bool(result);
+        }
         case LVAL_FLOAT: {
             int result = (v->num != 0);
             lval_del(v);
@@ -1305,7 +1976,7 @@ lval* builtin_head(lenv* e, lval* a) {
     LASSERT(a, (((lval*)list_index(a->cell, 0))->count != 0),         "Function 'head' passed {}.");
 
     /* otherwise take first arg */
-    lval* v = lval_take(a, 0);
+    lval* v = lval_unshare(lval_take(a, 0));
 
     /* delete all elements that are not head and return */
     while (v->count > 1) { lval_del(lval_pop(v, 1)); }
@@ -1319,7 +1990,7 @@ lval* builtin_tail(lenv* e, lval* a) {
     LASSERT(a, (((lval*)list_index(a->cell, 0))->count != 0),         "Function 'tail' passed {}.");
 
     /* Take first arg */
-    lval* v = lval_take(a, 0);
+    lval* v = lval_unshare(lval_take(a, 0));
 
     /* Delete the first element and return */
     lval_del(lval_pop(v, 0));
@@ -1398,6 +2069,12 @@ lval* builtin_list(lenv* e, lval* a) {
 }
 
 lval* builtin_if(lenv* e, lval* a) {
+    return lval_eval(e, lval_if_branch(e, a));
+}
+
+/* check the arguments to if and return the branch to take as an
+   unevaluated S-expression, or an error */
+lval* lval_if_branch(lenv* e, lval* a) {
     LASSERT(a, (a->count == 3), "Function 'if' passed incorrect number of arguments. Got %d, expected %d.", a->count, 3);
     int i = 0;
     list_start(a->cell);
@@ -1415,6 +2092,7 @@ lval* builtin_if(lenv* e, lval* a) {
     lval* falsecond = lval_pop(a, 0);
     lval* truth;
     if (condition->type == LVAL_QEXPR) {
+        condition = lval_unshare(condition);
         condition->type = LVAL_SEXPR;
         // lval_eval deletes condition
         truth = lval_eval(e, condition);
@@ -1427,13 +2105,15 @@ lval* builtin_if(lenv* e, lval* a) {
     if ((int) truth->num == 1) {
         lval_del(falsecond);
         lval_del(truth);
+        truecond = lval_unshare(truecond);
         truecond->type = LVAL_SEXPR;
-        return lval_eval(e, truecond);
+        return truecond;
     } else if ((int) truth->num == 0) {
         lval_del(truecond);
         lval_del(truth);
+        falsecond = lval_unshare(falsecond);
         falsecond->type = LVAL_SEXPR;
-        return lval_eval(e, falsecond);
+        return falsecond;
     } else {
         lval_del(truecond);
         lval_del(falsecond);
@@ -1447,7 +2127,7 @@ lval* builtin_eval(lenv* e, lval* a) {
     LASSERT(a, (a->count == 1),                  "Function 'eval' passed too many arguments. Got %d, expected %d.", a->count, 1);
     LASSERT(a, (((lval*)list_index(a->cell, 0))->type == LVAL_QEXPR), "Function 'eval' passed incorrect type. Got %s, expected %s", ltype_name(((lval*)list_index(a->cell, 0))->type), ltype_name(LVAL_QEXPR));
 
-    lval* x = lval_take(a, 0);
+    lval* x = lval_unshare(lval_take(a, 0));
     x->type = LVAL_SEXPR;
     return lval_eval(e, x);
 }
@@ -1460,7 +2140,7 @@ lval* builtin_join(lenv* e, lval* a) {
         list_iter(a->cell);
     }
 
-    lval* x = lval_pop(a, 0);
+    lval* x = lval_unshare(lval_pop(a, 0));
 
     while (a->count) {
         x = lval_join(x, lval_pop(a, 0));
@@ -1470,6 +2150,185 @@ lval* builtin_join(lenv* e, lval* a) {
     return x;
 }
 
+/* Higher order list functions. These walk the list once, calling
+   the function on each element in place instead of taking the list
+   apart with head and tail */
+
+/* call f with the arguments x (and y, if not NULL) */
+static lval* lval_call_with(lenv* e, lval* f, lval* x, lval* y) {
+    lval* args = lval_sexpr();
+    lval_add(args, lval_retain(x));
+    if (y) { lval_add(args, lval_retain(y)); }
+    return lval_call(e, f, args);
+}
+
+/* Apply a function to each element: (map f {1 2 3}) */
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval* f = list_index(a->cell, 0);
+    lval* l = list_index(a->cell, 1);
+    lval* result = lval_qexpr();
+    list_reserve(result->cell, l->count);
+    for (int i = 0; i < l->count; i++) {
+        lval* y = lval_call_with(e, f, list_index(l->cell, i), NULL);
+        if (y->type == LVAL_ERR) {
+            lval_del(result);
+            result = y;
+            break;
+        }
+        lval_add(result, y);
+    }
+    lval_del(a);
+    return result;
+}
+
+/* Keep the elements a predicate is true for: (filter f {1 2 3}) */
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* f = list_index(a->cell, 0);
+    lval* l = list_index(a->cell, 1);
+    lval* result = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        lval* x = list_index(l->cell, i);
+        lval* keep = lval_call_with(e, f, x, NULL);
+        if (keep->type != LVAL_BOOL) {
+            lval_del(result);
+            result = keep->type == LVAL_ERR ? keep :
+                lval_err("Function 'filter' needs a predicate returning Boolean. Got %s", ltype_name(keep->type));
+            if (result != keep) { lval_del(keep); }
+            break;
+        }
+        if (keep->num) { lval_add(result, lval_retain(x)); }
+        lval_del(keep);
+    }
+    lval_del(a);
+    return result;
+}
+
+/* fold the list l into acc, from the left or right. consumes acc */
+static lval* lval_fold(lenv* e, lval* f, lval* acc, lval* l, int right) {
+    for (int i = 0; i < l->count && acc->type != LVAL_ERR; i++) {
+        lval* next;
+        if (right) {
+            next = lval_call_with(e, f, list_index(l->cell, l->count - 1 - i), acc);
+        } else {
+            next = lval_call_with(e, f, acc, list_index(l->cell, i));
+        }
+        lval_del(acc);
+        acc = next;
+    }
+    return acc;
+}
+
+/* Fold from the left: (foldl f z {1 2 3}) -> (f (f (f z 1) 2) 3) */
+lval* builtin_foldl(lenv* e, lval* a) {
+    LASSERT_NUM("foldl", a, 3);
+    LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+    lval* r = lval_fold(e, list_index(a->cell, 0),
+                        lval_retain(list_index(a->cell, 1)), list_index(a->cell, 2), 0);
+    lval_del(a);
+    return r;
+}
+
+/* Fold from the right: (foldr f z {1 2 3}) -> (f 1 (f 2 (f 3 z))) */
+lval* builtin_foldr(lenv* e, lval* a) {
+    LASSERT_NUM("foldr", a, 3);
+    LASSERT_TYPE("foldr", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldr", a, 2, LVAL_QEXPR);
+
+    lval* r = lval_fold(e, list_index(a->cell, 0),
+                        lval_retain(list_index(a->cell, 1)), list_index(a->cell, 2), 1);
+    lval_del(a);
+    return r;
+}
+
+/* Integers from start up to end: (range 5), (range 2 5) or (range 0 10 2) */
+lval* builtin_range(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1 && a->count <= 3,
+            "Function 'range' passed incorrect number of arguments. Got %d, expected 1 to 3.", a->count);
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("range", a, i, LVAL_LONG);
+    }
+
+    int64_t start = 0, end, step = 1;
+    if (a->count == 1) {
+        end = ((lval*)list_index(a->cell, 0))->inum;
+    } else {
+        start = ((lval*)list_index(a->cell, 0))->inum;
+        end = ((lval*)list_index(a->cell, 1))->inum;
+    }
+    if (a->count == 3) { step = ((lval*)list_index(a->cell, 2))->inum; }
+    LASSERT(a, step != 0, "Function 'range' passed a step of 0.");
+    lval_del(a);
+
+    lval* result = lval_qexpr();
+    for (int64_t i = start; step > 0 ? i < end : i > end; i += step) {
+        lval_add(result, lval_long(i));
+    }
+    return result;
+}
+
+/* Reverse a list: (reverse {1 2 3}) -> {3 2 1} */
+lval* builtin_reverse(lenv* e, lval* a) {
+    LASSERT_NUM("reverse", a, 1);
+    LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+    lval* l = list_index(a->cell, 0);
+    lval* result = lval_qexpr();
+    list_reserve(result->cell, l->count);
+    for (int i = l->count - 1; i >= 0; i--) {
+        lval_add(result, lval_retain(list_index(l->cell, i)));
+    }
+    lval_del(a);
+    return result;
+}
+
+/* Element at an index, counting from 0: (nth 1 {a b c}) -> b */
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_LONG);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    int64_t i = ((lval*)list_index(a->cell, 0))->inum;
+    lval* l = list_index(a->cell, 1);
+    LASSERT(a, i >= 0 && i < l->count,
+            "Function 'nth' passed index %lld, list has %d elements.", (long long)i, l->count);
+
+    lval* x = lval_retain(list_index(l->cell, i));
+    lval_del(a);
+    return x;
+}
+
+/* Number of elements in a list, vector, dict or set: (len {1 2 3}) */
+lval* builtin_len(lenv* e, lval* a) {
+    LASSERT_NUM("len", a, 1);
+
+    lval* x = list_index(a->cell, 0);
+    int64_t n;
+    switch (x->type) {
+        case LVAL_QEXPR: n = x->count; break;
+        case LVAL_VEC:   n = x->vec.len; break;
+        case LVAL_DICT:
+        case LVAL_SET:   n = x->table.count; break;
+        default: {
+            lval* err = lval_err("Function 'len' passed incorrect type. Got %s, expected a collection.",
+                                 ltype_name(x->type));
+            lval_del(a);
+            return err;
+        }
+    }
+    lval_del(a);
+    return lval_long(n);
+}
+
 lval* builtin_lambda(lenv* e, lval* a) {
     // check two arguments, each of which are Q-expressions
     LASSERT_NUM("\\", a, 2);
@@ -1477,14 +2336,13 @@ lval* builtin_lambda(lenv* e, lval* a) {
     LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
 
     // check first Q expression contains only symbols
+    // index rather than iterate, another thread may be reading the same list
     lval* formals_check = (lval*)list_index(a->cell, 0);
-    list_start(formals_check->cell);
-    while (list_end(formals_check->cell)) {
-        lval* v = list_curr(formals_check->cell);
+    for (int i = 0; i < formals_check->count; i++) {
+        lval* v = list_index(formals_check->cell, i);
         LASSERT(a, (v->type == LVAL_SYM),
                 "Cannot define non-symbol. Got %s, expected %s.",
                 ltype_name(v->type), ltype_name(LVAL_SYM));
-        list_iter(formals_check->cell);
     }
 
     // pop first two arguments and pass them to lval lambda
@@ -1498,90 +2356,87 @@ lval* builtin_lambda(lenv* e, lval* a) {
 lval* builtin_var(lenv* e, lval* a, char* func) {
     LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
     lval* syms = (lval*)list_index(a->cell, 0);
-    list_start(syms->cell);
-    while (list_end(syms->cell)) {
-        lval* v = list_curr(syms->cell);
+    for (int i = 0; i < syms->count; i++) {
+        lval* v = list_index(syms->cell, i);
         LASSERT(a, (v->type == LVAL_SYM),
                 "Function '%s' cannot define non-symbol. Got %s, expected %s.",
                 func, ltype_name(v->type), ltype_name(LVAL_SYM));
-        list_iter(syms->cell);
     }
 
     LASSERT(a, (syms->count == a->count-1),
             "Function '%s' passed too many arguments for symbols. Got %d, expected %d.",
             func, syms->count, a->count-1);
 
-    /* Iterate over symbols and values together using index for values offset */
-    list_start(syms->cell);
-    int i = 0;
-    while (list_end(syms->cell)) {
-        lval* sym = list_curr(syms->cell);
+    /* symbols and values together, values are offset by one */
+    for (int i = 0; i < syms->count; i++) {
+        lval* sym = list_index(syms->cell, i);
         lval* val = (lval*)list_index(a->cell, i + 1);
         /* if def define in global scope. if put define in local scope */
         if (strcmp(func, "def") == 0) { lenv_def(e, sym, val); }
         if (strcmp(func, "="  ) == 0) { lenv_put(e, sym, val); }
-        list_iter(syms->cell);
-        i++;
     }
     
     lval_del(a);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "=");   }
 
 lval* lval_join(lval* x, lval* y) {
-    /* for each cell in y, add it to x */
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    /* for each cell in y, add it to x. the cells are shared with y,
+       so there is no need to unshare y first */
+    list_reserve(x->cell, x->count + y->count);
+    for (int i = 0; i < y->count; i++) {
+        x = lval_add(x, lval_retain(list_index(y->cell, i)));
     }
 
-    /* Delete the empty y and return x */
+    /* Delete y and return x */
     lval_del(y);
     return x;
 }
 
+/* copy the top level of v. children are shared with the original
+   since shared values are never mutated in place */
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
-    count_inc(v->type);
+    lval* x = lval_alloc(v->type);
     switch (v->type) {
         /* copy functions and numbers directly */
         case LVAL_FUN:
            if (v->builtin) {
                x->builtin = v->builtin;
+               x->code = NULL;
            } else {
                x->builtin = NULL;
-               x->env = lenv_copy(v->env);
-               x->formals = lval_copy(v->formals);
-               x->body = lval_copy(v->body);
+               // shared until a call binds into them
+               x->env = lenv_retain(v->env);
+               x->formals = lval_retain(v->formals);
+               x->body = lval_retain(v->body);
+               x->code = lcode_retain(v->code);
            }
            x->doc = v->doc ? strdup(v->doc) : NULL;
            break;
+        case LVAL_LONG: x->inum = v->inum; break;
         case LVAL_FLOAT:
-        case LVAL_BOOL:
-        case LVAL_LONG: x->num = v->num; break;
+        case LVAL_BOOL: x->num = v->num; break;
         case LVAL_FRAC:
            x->numer = v->numer;
            x->denom = v->denom;
            break;
 
-        /* copy strings using strdup */
+        /* copy strings using strdup, symbol names are interned and shared */
         case LVAL_STR:
-        case LVAL_ERR:
-        case LVAL_SYM: x->str = strdup(v->str); break;
+        case LVAL_ERR: x->str = strdup(v->str); break;
+        case LVAL_SYM: x->str = v->str; x->hash = v->hash; break;
 
         /* copy lists by copying each sub expression */
         case LVAL_SEXPR:
         case LVAL_QEXPR:
           x->count = v->count;
           x->cell = list_init();
-          list_start(v->cell);
-          while (list_end(v->cell)) {
-              lval* elem = list_curr(v->cell);
-              list_push(x->cell, lval_copy(elem));
-              list_iter(v->cell);
+          list_reserve(x->cell, v->count);
+          for (int i = 0; i < v->count; i++) {
+              list_push(x->cell, lval_retain(list_index(v->cell, i)));
           }
           break;
 
@@ -1589,8 +2444,13 @@ lval* lval_copy(lval* v) {
         case LVAL_UTYPE:
         case LVAL_UVAL:
           x->type_name = strdup(v->type_name);
-          x->fields = lval_copy(v->fields);
+          x->fields = lval_retain(v->fields);
           break;
+
+        /* dicts share their table until one of them is updated */
+        case LVAL_DICT:
+        case LVAL_SET: ltable_copy(&x->table, &v->table); break;
+        case LVAL_VEC: lvec_copy(&x->vec, &v->vec); break;
     }
 
     return x;
@@ -1599,22 +2459,32 @@ lval* lval_copy(lval* v) {
 /* print sexpr */
 void lval_expr_print(lval* v, char open, char close) {
     putchar(open);
-    int first = 1;
-    list_start(v->cell);
-    while (list_end(v->cell)) {
-        lval* elem = list_curr(v->cell);
+    /* index rather than iterate, v may be shared with another thread */
+    for (int i = 0; i < v->count; i++) {
         /* print space before all but first element */
-        if (!first) {
+        if (i > 0) {
             putchar(' ');
         }
         /* print value contained within */
-        lval_print(elem);
-        first = 0;
-        list_iter(v->cell);
+        lval_print(list_index(v->cell, i));
     }
     putchar(close);
 }
 
+static int lval_print_item(lval* key, lval* v, void* first) {
+    if (!*(int*)first) { putchar(' '); }
+    lval_print(key); putchar(' '); lval_print(v);
+    *(int*)first = 0;
+    return 1;
+}
+
+static int lval_print_member(lval* key, lval* v, void* first) {
+    if (!*(int*)first) { putchar(' '); }
+    lval_print(key);
+    *(int*)first = 0;
+    return 1;
+}
+
 /* Print an lval */
 void lval_print(lval* v) {
     switch (v->type) {
@@ -1628,7 +2498,7 @@ void lval_print(lval* v) {
             }
             break;
         case LVAL_STR:   lval_print_str(v); break;
-        case LVAL_LONG:  printf("%li", (long) v->num); break;
+        case LVAL_LONG:  printf("%lld", (long long) v->inum); break;
         case LVAL_FLOAT: printf("%g", v->num); break;
         case LVAL_FRAC:  printf("%ld/%ld", v->numer, v->denom); break;
         case LVAL_BOOL:  printf("%s", (int) v->num ? "true" : "false"); break;
@@ -1646,6 +2516,26 @@ void lval_print(lval* v) {
             lval_print(v->fields);
             printf(">");
             break;
+        case LVAL_DICT: {
+            int first = 1;
+            printf("<dict {");
+            ltable_traverse(&v->table, lval_print_item, &first);
+            printf("}>");
+        } break;
+        case LVAL_SET: {
+            int first = 1;
+            printf("<set {");
+            ltable_traverse(&v->table, lval_print_member, &first);
+            printf("}>");
+        } break;
+        case LVAL_VEC:
+            printf("<vec {");
+            for (int i = 0; i < v->vec.len; i++) {
+                if (i) { putchar(' '); }
+                lval_print(lvec_get(&v->vec, i));
+            }
+            printf("}>");
+            break;
     }
 }
 
@@ -1656,6 +2546,8 @@ lval* lval_to_str(lval* v) {
     char buffer[65];
     switch (v->type) {
         case LVAL_LONG:
+            snprintf(buffer, 64, "%lld", (long long) v->inum);
+            return lval_str(buffer);
         case LVAL_FLOAT:
             snprintf(buffer, 64, "%g", v->num);
           //  lval_del(v);
@@ -1668,8 +2560,10 @@ lval* lval_to_str(lval* v) {
             } break;
         case LVAL_STR:
         case LVAL_ERR:
-        case LVAL_SYM:
             return v;
+        case LVAL_SYM:
+            // the name is interned, so the string needs its own copy
+            return lval_str(v->str);
         case LVAL_SEXPR:
         case LVAL_QEXPR:
         case LVAL_FUN:
@@ -1693,42 +2587,124 @@ void lval_print_str(lval* v) {
     free(escaped);
 }
 
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+/* frames come from the slab with their slots right after them */
+static lenv* lenv_alloc(int nslots) {
+    lenv* e = slab_alloc(sizeof(lenv) + sizeof(symtab_entry) * nslots);
+    e->refs = 1;
     e->par = NULL;
     e->count = 0;
-    e->syms = hash_create(51);
+    symtab_init(&e->syms);
+    e->frame = 0;
+    e->nslots = nslots;
+    e->slots = (symtab_entry*)(e + 1);
+    return e;
+}
+
+lenv* lenv_new(void) {
+    return lenv_alloc(0);
+}
+
+/* a frame with an empty slot for each formal, & excepted */
+lenv* lenv_frame(lval* formals) {
+    int n = 0;
+    for (int i = 0; i < formals->count; i++) {
+        lval* sym = list_index(formals->cell, i);
+        if (strcmp(sym->str, "&") != 0) { n++; }
+    }
+    lenv* e = lenv_alloc(n);
+    e->frame = 1;
+    n = 0;
+    for (int i = 0; i < formals->count; i++) {
+        lval* sym = list_index(formals->cell, i);
+        if (strcmp(sym->str, "&") == 0) { continue; }
+        e->slots[n].key = sym->str;
+        e->slots[n].hash = sym->hash;
+        e->slots[n].val = NULL;
+        intern_mark_local(sym->str);
+        n++;
+    }
     return e;
 }
 
+/* the slot binding key in e, if any */
+static symtab_entry* lenv_slot(lenv* e, char* key) {
+    for (int i = 0; i < e->nslots; i++) {
+        if (e->slots[i].key == key) { return &e->slots[i]; }
+    }
+    return NULL;
+}
+
+static int lenv_hash_purge(char* key, lval* v, void* unused) {
+    lval_del(v);
+    return 1;
+}
+
+lenv* lenv_retain(lenv* e) {
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+    return e;
+}
+
+/* return a version of e that is safe to bind into */
+lenv* lenv_unshare(lenv* e) {
+    if (__atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) == 1) { return e; }
+    lenv* n = lenv_copy(e);
+    lenv_del(e);
+    return n;
+}
+
+/* release a reference to an env, freeing it once nobody owns it */
 void lenv_del(lenv* e) {
-    hash_purge(e->syms, lenv_hash_purge);
-    free(e->syms);
-    free(e);
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+    for (int i = 0; i < e->nslots; i++) {
+        if (e->slots[i].val) { lval_del(e->slots[i].val); }
+    }
+    symtab_traverse(&e->syms, lenv_hash_purge, NULL);
+    symtab_free(&e->syms);
+    slab_free(e, sizeof(lenv) + sizeof(symtab_entry) * e->nslots);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    lval* z = hash_search(e->syms, k->str, NULL, NULL);
-    if (z != NULL) {
-        return lval_copy(z);
-    } else if (e->par) {
-        // if no symbol found, check in the parent
-        return lenv_get(e->par, k);
-    } else {
-        /* if no symbol found, return error */
-        return lval_err("Unbound symbol '%s'", k->str);
+/* look up an interned name, probing each scope with its cached hash */
+lval* lenv_lookup(lenv* e, char* key, unsigned hash) {
+    /* scope is dynamic, so any caller's frame could bind key. if no
+       frame ever has, it can only be in the global env */
+    if (!intern_is_local(key)) {
+        while (e->par) { e = e->par; }
     }
+    for (lenv* s = e; s; s = s->par) {
+        symtab_entry* slot = lenv_slot(s, key);
+        if (slot && slot->val) { return lval_retain(slot->val); }
+        lval* z = symtab_get(&s->syms, key, hash);
+        if (z != NULL) { return lval_retain(z); }
+    }
+    /* if no symbol found, return error */
+    return lval_err("Unbound symbol '%s'", key);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    return lenv_lookup(e, k->str, k->hash);
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-    /* iterate over items in environment to see if variable already exists */
-    lval* z = hash_search(e->syms, k->str, lval_copy(v), lval_del);
+    symtab_entry* slot = lenv_slot(e, k->str);
+    if (slot) {
+        if (slot->val) {
+            lval_del(slot->val);
+        } else {
+            e->count++;
+        }
+        slot->val = lval_retain(v);
+        return;
+    }
 
-    // hash_search returns NULL if a key exists and value is replaced
+    if (e->frame) { intern_mark_local(k->str); }
+    lval* z = symtab_put(&e->syms, k->str, k->hash, lval_retain(v));
+
+    // symtab_put returns the old value if the key was already bound
     if (z != NULL) {
+        lval_del(z);
+    } else {
         e->count++;
     }
-    // should v be deleted?
 }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func, char* doc) {
@@ -1774,6 +2750,38 @@ void lenv_add_builtins(lenv* e) {
         "Join multiple lists together.\n"
         "  Usage: (join {list1} {list2} ...)\n"
         "  Example: (join {1 2} {3 4}) -> {1 2 3 4}");
+    lenv_add_builtin(e, "map", builtin_map,
+        "Apply a function to each element of a list.\n"
+        "  Usage: (map func {list})\n"
+        "  Example: (map (\\ {x} {* x x}) {1 2 3}) -> {1 4 9}");
+    lenv_add_builtin(e, "filter", builtin_filter,
+        "Keep the elements of a list a predicate is true for.\n"
+        "  Usage: (filter func {list})\n"
+        "  Example: (filter (\\ {x} {gt x 1}) {1 2 3}) -> {2 3}");
+    lenv_add_builtin(e, "foldl", builtin_foldl,
+        "Combine the elements of a list from the left.\n"
+        "  Usage: (foldl func init {list})\n"
+        "  Example: (foldl + 0 {1 2 3}) -> 6");
+    lenv_add_builtin(e, "foldr", builtin_foldr,
+        "Combine the elements of a list from the right.\n"
+        "  Usage: (foldr func init {list})\n"
+        "  Example: (foldr - 0 {1 2 3}) -> 2");
+    lenv_add_builtin(e, "range", builtin_range,
+        "List the integers from start up to, not including, end.\n"
+        "  Usage: (range end), (range start end) or (range start end step)\n"
+        "  Example: (range 1 4) -> {1 2 3}");
+    lenv_add_builtin(e, "reverse", builtin_reverse,
+        "Reverse a list.\n"
+        "  Usage: (reverse {list})\n"
+        "  Example: (reverse {1 2 3}) -> {3 2 1}");
+    lenv_add_builtin(e, "nth", builtin_nth,
+        "Get the element of a list at an index, counting from 0.\n"
+        "  Usage: (nth index {list})\n"
+        "  Example: (nth 1 {a b c}) -> b");
+    lenv_add_builtin(e, "len", builtin_len,
+        "Get the number of elements in a list, vector, dict or set.\n"
+        "  Usage: (len {list})\n"
+        "  Example: (len {1 2 3}) -> 3");
 
     /* maths */
     lenv_add_builtin(e, "+", builtin_add,
@@ -1864,6 +2872,16 @@ void lenv_add_builtins(lenv* e) {
         "Load and execute a lispy file.\n"
         "  Usage: (load \"filename\")\n"
         "  Example: (load \"stdlib.lspy\")");
+    lenv_add_builtin(e, "compile", builtin_compile,
+        "Cache the forms of a lispy file in an image beside it, which load reads\n"
+        "instead of the file for as long as the file is unchanged.\n"
+        "  Usage: (compile \"filename\")\n"
+        "  Example: (compile \"stdlib.lspy\") -> \"stdlib.lspyc\"");
+    lenv_add_builtin(e, "save-image", builtin_save_image,
+        "Write the global environment to an image, which lispy --image starts\n"
+        "up with in place of evaluating the code that defined it.\n"
+        "  Usage: (save-image \"filename\")\n"
+        "  Example: (save-image \"prelude.img\")");
     lenv_add_builtin(e, "print", builtin_print,
         "Print values to stdout.\n"
         "  Usage: (print val1 val2 ...)\n"
@@ -1897,6 +2915,96 @@ void lenv_add_builtins(lenv* e) {
         "  Usage: (set instance 'field value)\n"
         "  Example: (set p 'x 10)");
 
+    // dictionaries
+    lenv_add_builtin(e, "dict", builtin_dict,
+        "Create a dictionary from keys and values.\n"
+        "  Usage: (dict {key1 val1 key2 val2 ...})\n"
+        "  Example: (dict {a 1 b 2})");
+    lenv_add_builtin(e, "dict-get", builtin_dict_get,
+        "Get the value bound to a key.\n"
+        "  Usage: (dict-get dict {key})\n"
+        "  Example: (dict-get d {a}) or (dict-get d 5)");
+    lenv_add_builtin(e, "dict-set", builtin_dict_set,
+        "Bind a key to a value - returns a new dictionary.\n"
+        "  Usage: (dict-set dict {key} value)\n"
+        "  Example: (dict-set d {c} 3)");
+    lenv_add_builtin(e, "dict-del", builtin_dict_del,
+        "Remove a key - returns a new dictionary.\n"
+        "  Usage: (dict-del dict {key})\n"
+        "  Example: (dict-del d {a})");
+    lenv_add_builtin(e, "dict-has", builtin_dict_has,
+        "Check whether a key is bound.\n"
+        "  Usage: (dict-has dict {key})\n"
+        "  Example: (dict-has d {a})");
+    lenv_add_builtin(e, "dict-keys", builtin_dict_keys,
+        "List the keys of a dictionary.\n"
+        "  Usage: (dict-keys dict)\n"
+        "  Example: (dict-keys d) -> {a b}");
+    lenv_add_builtin(e, "dict-items", builtin_dict_items,
+        "List the key value pairs of a dictionary.\n"
+        "  Usage: (dict-items dict)\n"
+        "  Example: (dict-items d) -> {{a 1} {b 2}}");
+
+    // vectors
+    lenv_add_builtin(e, "vec", builtin_vec,
+        "Create a vector of values.\n"
+        "  Usage: (vec val1 val2 ...)\n"
+        "  Example: (vec 1 2 3)");
+    lenv_add_builtin(e, "vec-get", builtin_vec_get,
+        "Get the element at an index, counting from 0.\n"
+        "  Usage: (vec-get vec index)\n"
+        "  Example: (vec-get v 0)");
+    lenv_add_builtin(e, "vec-set", builtin_vec_set,
+        "Replace the element at an index - returns a new vector.\n"
+        "  Usage: (vec-set vec index value)\n"
+        "  Example: (vec-set v 0 7)");
+    lenv_add_builtin(e, "vec-push", builtin_vec_push,
+        "Add an element at the end - returns a new vector.\n"
+        "  Usage: (vec-push vec value)\n"
+        "  Example: (vec-push v 4)");
+    lenv_add_builtin(e, "vec-len", builtin_vec_len,
+        "Get the number of elements in a vector.\n"
+        "  Usage: (vec-len vec)\n"
+        "  Example: (vec-len (vec 1 2 3)) -> 3");
+    lenv_add_builtin(e, "vec-list", builtin_vec_list,
+        "Convert a vector to a Q-expression.\n"
+        "  Usage: (vec-list vec)\n"
+        "  Example: (vec-list (vec 1 2 3)) -> {1 2 3}");
+
+    // sets
+    lenv_add_builtin(e, "set-of", builtin_set_of,
+        "Create a set of values.\n"
+        "  Usage: (set-of val1 val2 ...)\n"
+        "  Example: (set-of 1 2 3)");
+    lenv_add_builtin(e, "set-add", builtin_set_add,
+        "Add values to a set - returns a new set.\n"
+        "  Usage: (set-add set val1 val2 ...)\n"
+        "  Example: (set-add s 4)");
+    lenv_add_builtin(e, "set-del", builtin_set_del,
+        "Remove values from a set - returns a new set.\n"
+        "  Usage: (set-del set val1 val2 ...)\n"
+        "  Example: (set-del s 4)");
+    lenv_add_builtin(e, "set-contains", builtin_set_contains,
+        "Check whether a value is in a set.\n"
+        "  Usage: (set-contains set value)\n"
+        "  Example: (set-contains s 2)");
+    lenv_add_builtin(e, "set-list", builtin_set_list,
+        "List the members of a set.\n"
+        "  Usage: (set-list set)\n"
+        "  Example: (set-list (set-of 1 2)) -> {1 2}");
+    lenv_add_builtin(e, "union", builtin_union,
+        "Values in any of the sets.\n"
+        "  Usage: (union set1 set2 ...)\n"
+        "  Example: (union (set-of 1 2) (set-of 2 3))");
+    lenv_add_builtin(e, "intersection", builtin_intersection,
+        "Values in all of the sets.\n"
+        "  Usage: (intersection set1 set2 ...)\n"
+        "  Example: (intersection (set-of 1 2) (set-of 2 3))");
+    lenv_add_builtin(e, "difference", builtin_difference,
+        "Values in the first set but none of the others.\n"
+        "  Usage: (difference set1 set2 ...)\n"
+        "  Example: (difference (set-of 1 2) (set-of 2 3))");
+
     // fractions
     lenv_add_builtin(e, "frac", builtin_frac,
         "Create a fraction (rational number).\n"
@@ -1926,6 +3034,10 @@ void lenv_add_builtins(lenv* e) {
         "Wait for a thread to complete and get its result.\n"
         "  Usage: (wait thread)\n"
         "  Example: (wait t)");
+    lenv_add_builtin(e, "pmap", builtin_pmap,
+        "Apply a function to each element of a list across worker threads.\n"
+        "  Usage: (pmap func {list})\n"
+        "  Example: (pmap (\\ {x} {* x x}) {1 2 3}) -> {1 4 9}");
 
     // game/terminal functions
     lenv_add_builtin(e, "random", builtin_random,
@@ -1972,23 +3084,55 @@ void lenv_add_builtins(lenv* e) {
         "Get current time in milliseconds.\n"
         "  Usage: (time-ms)\n"
         "  Example: (time-ms)");
+    lenv_add_builtin(e, "gc", builtin_gc,
+        "Free values only kept alive by cycles or lost references.\n"
+        "  Runs once the current top level form has finished.\n"
+        "  Usage: (gc)");
     lenv_add_builtin(e, "do", builtin_do,
         "Evaluate expressions in sequence, return last result.\n"
         "  Usage: (do expr1 expr2 ...)\n"
         "  Example: (do (print \"a\") (print \"b\"))");
 }
 
+static int lenv_hash_retain(char* key, lval* v, void* unused) {
+    lval_retain(v);
+    return 1;
+}
+
 lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
+    lenv* n = lenv_alloc(e->nslots);
+    n->frame = e->frame;
     n->par = e->par;
     n->count = e->count;
-    // here, maybe could use e->count + some
-    n->syms = hash_create(51);
-    hash_traverse(e->syms, lenv_hash_copy_kv, n->syms);
+    for (int i = 0; i < e->nslots; i++) {
+        n->slots[i] = e->slots[i];
+        if (n->slots[i].val) { lval_retain(n->slots[i].val); }
+    }
+    symtab_copy(&n->syms, &e->syms);
+    symtab_traverse(&n->syms, lenv_hash_retain, NULL);
+
+    return n;
+}
 
+/* a copy of e and of every scope above it, for a task on another
+   thread. it shares values but no env, so the task neither sees nor
+   makes changes to the bindings of the thread that spawned it, def
+   included */
+lenv* lenv_snapshot(lenv* e) {
+    lenv* n = lenv_copy(e);
+    for (lenv* s = n; s->par; s = s->par) { s->par = lenv_copy(s->par); }
     return n;
 }
 
+/* release a snapshot along with the scopes above it */
+void lenv_snapshot_del(lenv* e) {
+    while (e) {
+        lenv* par = e->par;
+        lenv_del(e);
+        e = par;
+    }
+}
+
 void lenv_def(lenv* e, lval* k, lval* v) {
     /* iterate until e has no parent */
     while (e->par) { e = e->par; }
@@ -1996,25 +3140,11 @@ void lenv_def(lenv* e, lval* k, lval* v) {
     lenv_put(e, k, v);
 }
 
-// used to clear hash table
-void lenv_hash_purge(char* key, lval* v) {
-    free(key);
-    lval_del(v);
-}
-
 int lenv_hash_print_keys(char* key, lval* v, void* n) {
     printf("%s ", key);
     return 1;
 }
 
-int lenv_hash_copy_kv(char* key, lval* v, hash_table* h) {
-    // assuming that the source table won't have dupe keys
-    
-    // do I need to create a fresh key with strdup?
-    lval* z = lval_copy(v);
-    hash_search(h, key, z, NULL);
-    return 1;
-}
 
 char *ltype_name(int t) {
     switch(t) {
@@ -2030,33 +3160,41 @@ char *ltype_name(int t) {
         case LVAL_UTYPE: return "User-Type";
         case LVAL_UVAL: return "User-Value";
         case LVAL_FRAC: return "Fraction";
+        case LVAL_DICT: return "Dictionary";
+        case LVAL_VEC: return "Vector";
+        case LVAL_SET: return "Set";
         default: return "Unknown";
     }
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    count_inc(v->type);
+    lval* v = lval_alloc(LVAL_FUN);
 
     v->builtin = NULL;
     v->doc = NULL;
 
-    // set up new environment for function (scope)
-    v->env = lenv_new();
+    // set up new environment for function (scope), a slot per formal
+    v->env = lenv_frame(formals);
 
     v->formals = formals;
     v->body = body;
-    // should we free formals and body?
+    // compile once here, every copy of the function shares the code.
+    // formals are resolved to their slots in env
+    v->code = lcode_compile(body, v->env);
     return v;
 }
 
 /* string related */
 lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
+    lval* v = lval_alloc(LVAL_STR);
     v->str = strdup(s);
-    count_inc(v->type);
+    return v;
+}
+
+/* takes s, which must have come from malloc */
+lval* lval_str_take(char* s) {
+    lval* v = lval_alloc(LVAL_STR);
+    v->str = s;
     return v;
 }
 
@@ -2072,39 +3210,35 @@ lval* lval_read_str(mpc_ast_t* t) {
 /* number related */
 
 /* Create a new number type lval */
-lval* lval_long(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_LONG;
-    v->num = (float) x;
-    count_inc(v->type);
+lval* lval_long(int64_t x) {
+    if (x >= SMALL_INT_MIN && x <= SMALL_INT_MAX) {
+        return &immortals[IMM_INTS + (x - SMALL_INT_MIN)];
+    }
+    lval* v = lval_alloc(LVAL_LONG);
+    v->inum = x;
     return v;
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
     if (strstr(t->contents, ".")) {
-        float f = strtof(t->contents, NULL);
+        double f = strtod(t->contents, NULL);
         return errno != ERANGE ? lval_float(f) : lval_err("Invalid Float");
     } else {
-        long x = strtol(t->contents, NULL, 10);
+        int64_t x = strtoll(t->contents, NULL, 10);
         return errno != ERANGE ? lval_long(x) : lval_err("invalid number");    
     }
 }
 
-lval* lval_float(float x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FLOAT;
+lval* lval_float(double x) {
+    lval* v = lval_alloc(LVAL_FLOAT);
     v->num = x;
-    count_inc(v->type);
     return v;
 }
 
 /* booleans */
 lval* lval_bool(int truth) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_BOOL;
-    v->num  = truth;
-    count_inc(v->type);
-    return v;
+    return &immortals[truth ? IMM_TRUE : IMM_FALSE];
 }
 
 lval* lval_read_bool(mpc_ast_t* t) {
@@ -2119,12 +3253,9 @@ lval* lval_read_bool(mpc_ast_t* t) {
 
 lval* bool_negate_val(lval* l) {
     LASSERT(l, (l->type == LVAL_BOOL), "Function 'bool_negate_val' passed wrong type. Got %s, expected %s.", ltype_name(l->type), ltype_name(LVAL_BOOL));
-    if ((int)l->num == 0) {
-        l->num = 1; 
-    } else if ((int)l->num == 1) {
-        l->num = 0;
-    }
-    return l;
+    int truth = l->num != 0;
+    lval_del(l);
+    return lval_bool(!truth);
 }
 
 lval* bool_negate_expr(lval* l) {
@@ -2132,13 +3263,7 @@ lval* bool_negate_expr(lval* l) {
     LASSERT_TYPE("not", l, 0, LVAL_BOOL);
     lval* v = lval_pop(l, 0);
     lval_del(l);
-
-    if ((int)v->num == 0) {
-        v->num = 1; 
-    } else if ((int)v->num == 1) {
-        v->num = 0;
-    }
-    return v;
+    return bool_negate_val(v);
 }
 
 lval* builtin_and(lenv* e, lval* l) {
@@ -2183,21 +3308,17 @@ lval* builtin_or(lenv* e, lval* l) {
 
 /* Create a new user type definition */
 lval* lval_utype(char* name, lval* fields) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_UTYPE;
+    lval* v = lval_alloc(LVAL_UTYPE);
     v->type_name = strdup(name);
     v->fields = fields;
-    count_inc(v->type);
     return v;
 }
 
 /* Create a new user type instance */
 lval* lval_uval(char* type_name, lval* values) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_UVAL;
+    lval* v = lval_alloc(LVAL_UVAL);
     v->type_name = strdup(type_name);
     v->fields = values;
-    count_inc(v->type);
     return v;
 }
 
@@ -2217,20 +3338,19 @@ lval* builtin_deftype(lenv* e, lval* a) {
         lval_del(a);
         return lval_err("Type name must be a single symbol in a Q-expression");
     }
+    name_qexpr = lval_unshare(name_qexpr);
     lval* name = lval_pop(name_qexpr, 0);
     lval_del(name_qexpr);
 
     /* Verify all field names are symbols */
-    list_start(field_names->cell);
-    while (list_end(field_names->cell)) {
-        lval* field = list_curr(field_names->cell);
+    for (int i = 0; i < field_names->count; i++) {
+        lval* field = list_index(field_names->cell, i);
         if (field->type != LVAL_SYM) {
             lval_del(name);
             lval_del(field_names);
             lval_del(a);
             return lval_err("Field names must be symbols");
         }
-        list_iter(field_names->cell);
     }
 
     /* Create the type and bind it */
@@ -2240,7 +3360,7 @@ lval* builtin_deftype(lenv* e, lval* a) {
     lval_del(name);
     lval_del(utype);
     lval_del(a);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Create instance: (new {Point} 10 20) */
@@ -2255,6 +3375,7 @@ lval* builtin_new(lenv* e, lval* a) {
         lval_del(a);
         return lval_err("Type name must be a single symbol in a Q-expression");
     }
+    name_qexpr = lval_unshare(name_qexpr);
     lval* type_sym = lval_pop(name_qexpr, 0);
     lval_del(name_qexpr);
 
@@ -2314,6 +3435,7 @@ lval* builtin_get(lenv* e, lval* a) {
         lval_del(a);
         return lval_err("Field name must be a single symbol in a Q-expression");
     }
+    field_qexpr = lval_unshare(field_qexpr);
     lval* field_name = lval_pop(field_qexpr, 0);
     lval_del(field_qexpr);
 
@@ -2332,16 +3454,12 @@ lval* builtin_get(lenv* e, lval* a) {
 
     /* Find field index */
     int index = -1;
-    int i = 0;
-    list_start(utype->fields->cell);
-    while (list_end(utype->fields->cell)) {
-        lval* field = list_curr(utype->fields->cell);
+    for (int i = 0; i < utype->fields->count; i++) {
+        lval* field = list_index(utype->fields->cell, i);
         if (strcmp(field->str, field_name->str) == 0) {
             index = i;
             break;
         }
-        i++;
-        list_iter(utype->fields->cell);
     }
 
     if (index == -1) {
@@ -2355,7 +3473,7 @@ lval* builtin_get(lenv* e, lval* a) {
     }
 
     /* Get the value at that index */
-    lval* result = lval_copy((lval*)list_index(instance->fields->cell, index));
+    lval* result = lval_retain((lval*)list_index(instance->fields->cell, index));
 
     lval_del(instance);
     lval_del(field_name);
@@ -2381,6 +3499,7 @@ lval* builtin_set(lenv* e, lval* a) {
         lval_del(a);
         return lval_err("Field name must be a single symbol in a Q-expression");
     }
+    field_qexpr = lval_unshare(field_qexpr);
     lval* field_name = lval_pop(field_qexpr, 0);
     lval_del(field_qexpr);
 
@@ -2400,16 +3519,12 @@ lval* builtin_set(lenv* e, lval* a) {
 
     /* Find field index */
     int index = -1;
-    int i = 0;
-    list_start(utype->fields->cell);
-    while (list_end(utype->fields->cell)) {
-        lval* field = list_curr(utype->fields->cell);
+    for (int i = 0; i < utype->fields->count; i++) {
+        lval* field = list_index(utype->fields->cell, i);
         if (strcmp(field->str, field_name->str) == 0) {
             index = i;
             break;
         }
-        i++;
-        list_iter(utype->fields->cell);
     }
 
     if (index == -1) {
@@ -2425,17 +3540,13 @@ lval* builtin_set(lenv* e, lval* a) {
 
     /* Create a new instance with the updated value */
     lval* new_values = lval_qexpr();
-    i = 0;
-    list_start(instance->fields->cell);
-    while (list_end(instance->fields->cell)) {
-        lval* v = list_curr(instance->fields->cell);
+    for (int i = 0; i < instance->fields->count; i++) {
+        lval* v = list_index(instance->fields->cell, i);
         if (i == index) {
-            lval_add(new_values, lval_copy(new_value));
+            lval_add(new_values, lval_retain(new_value));
         } else {
-            lval_add(new_values, lval_copy(v));
+            lval_add(new_values, lval_retain(v));
         }
-        i++;
-        list_iter(instance->fields->cell);
     }
 
     lval* result = lval_uval(instance->type_name, new_values);
@@ -2448,6 +3559,439 @@ lval* builtin_set(lenv* e, lval* a) {
     return result;
 }
 
+/* Dictionaries */
+
+lval* lval_dict(void) {
+    lval* v = lval_alloc(LVAL_DICT);
+    ltable_init(&v->table);
+    return v;
+}
+
+/* a key is written like a field name, {a}, or given as a plain value
+   such as a number or a string. consumes k */
+static lval* dict_key(lval* k) {
+    if (k->type == LVAL_QEXPR && k->count == 1) {
+        lval* x = lval_retain(list_index(k->cell, 0));
+        lval_del(k);
+        k = x;
+    }
+    if (!lval_hashable(k)) {
+        lval* err = lval_err("Cannot use a %s as a dictionary key", ltype_name(k->type));
+        lval_del(k);
+        return err;
+    }
+    return k;
+}
+
+
+/* Create a dictionary: (dict {a 1 b 2}) */
+lval* builtin_dict(lenv* e, lval* a) {
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_dict();
+    }
+    LASSERT_NUM("dict", a, 1);
+    LASSERT_TYPE("dict", a, 0, LVAL_QEXPR);
+    lval* kv = lval_pop(a, 0);
+    lval_del(a);
+    if (kv->count % 2 != 0) {
+        lval_del(kv);
+        return lval_err("Function 'dict' needs a value for every key");
+    }
+
+    lval* d = lval_dict();
+    for (int i = 0; i < kv->count; i += 2) {
+        lval* key = list_index(kv->cell, i);
+        if (!lval_hashable(key)) {
+            lval* err = lval_err("Cannot use a %s as a dictionary key", ltype_name(key->type));
+            lval_del(kv);
+            lval_del(d);
+            return err;
+        }
+        ltable_put(&d->table, lval_retain(key), lval_hash(key), lval_retain(list_index(kv->cell, i + 1)));
+    }
+    lval_del(kv);
+    return d;
+}
+
+/* Look up a key: (dict-get d {a}) */
+lval* builtin_dict_get(lenv* e, lval* a) {
+    LASSERT_NUM("dict-get", a, 2);
+    LASSERT_TYPE("dict-get", a, 0, LVAL_DICT);
+
+    lval* d = lval_pop(a, 0);
+    lval* key = dict_key(lval_pop(a, 0));
+    lval_del(a);
+    if (key->type == LVAL_ERR) {
+        lval_del(d);
+        return key;
+    }
+
+    lval* v = ltable_get(&d->table, key, lval_hash(key));
+    lval* result = v ? lval_retain(v) : lval_err("Key not found in dictionary");
+    lval_del(key);
+    lval_del(d);
+    return result;
+}
+
+/* Bind a key: (dict-set d {c} 3) - returns the new dictionary, which
+   shares all but the path down to the key with the old one */
+lval* builtin_dict_set(lenv* e, lval* a) {
+    LASSERT_NUM("dict-set", a, 3);
+    LASSERT_TYPE("dict-set", a, 0, LVAL_DICT);
+
+    lval* d = lval_pop(a, 0);
+    lval* key = dict_key(lval_pop(a, 0));
+    lval* v = lval_pop(a, 0);
+    lval_del(a);
+    if (key->type == LVAL_ERR) {
+        lval_del(d);
+        lval_del(v);
+        return key;
+    }
+
+    d = lval_unshare(d);
+    ltable_put(&d->table, key, lval_hash(key), v);
+    return d;
+}
+
+/* Remove a key: (dict-del d {a}) - returns the new dictionary */
+lval* builtin_dict_del(lenv* e, lval* a) {
+    LASSERT_NUM("dict-del", a, 2);
+    LASSERT_TYPE("dict-del", a, 0, LVAL_DICT);
+
+    lval* d = lval_pop(a, 0);
+    lval* key = dict_key(lval_pop(a, 0));
+    lval_del(a);
+    if (key->type == LVAL_ERR) {
+        lval_del(d);
+        return key;
+    }
+
+    unsigned hash = lval_hash(key);
+    if (ltable_get(&d->table, key, hash)) {
+        d = lval_unshare(d);
+        ltable_remove(&d->table, key, hash);
+    }
+    lval_del(key);
+    return d;
+}
+
+/* Check for a key: (dict-has d {a}) */
+lval* builtin_dict_has(lenv* e, lval* a) {
+    LASSERT_NUM("dict-has", a, 2);
+    LASSERT_TYPE("dict-has", a, 0, LVAL_DICT);
+
+    lval* d = lval_pop(a, 0);
+    lval* key = dict_key(lval_pop(a, 0));
+    lval_del(a);
+    if (key->type == LVAL_ERR) {
+        lval_del(d);
+        return key;
+    }
+
+    lval* result = lval_bool(ltable_get(&d->table, key, lval_hash(key)) != NULL);
+    lval_del(key);
+    lval_del(d);
+    return result;
+}
+
+static int dict_add_key(lval* key, lval* v, void* result) {
+    lval_add(result, lval_retain(key));
+    return 1;
+}
+
+static int dict_add_item(lval* key, lval* v, void* result) {
+    lval* pair = lval_qexpr();
+    lval_add(pair, lval_retain(key));
+    lval_add(pair, lval_retain(v));
+    lval_add(result, pair);
+    return 1;
+}
+
+/* the keys, or {key value} pairs, of a dictionary (or the members of a
+   set) as a Q-expression */
+static lval* dict_list(lval* a, char* func, int type, int (*add)(lval*, lval*, void*)) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, type);
+
+    lval* d = lval_pop(a, 0);
+    lval_del(a);
+    lval* result = lval_qexpr();
+    list_reserve(result->cell, d->table.count);
+    ltable_traverse(&d->table, add, result);
+    lval_del(d);
+    return result;
+}
+
+lval* builtin_dict_keys(lenv* e, lval* a)  { return dict_list(a, "dict-keys", LVAL_DICT, dict_add_key); }
+lval* builtin_dict_items(lenv* e, lval* a) { return dict_list(a, "dict-items", LVAL_DICT, dict_add_item); }
+
+/* Vectors */
+
+lval* lval_vec(void) {
+    lval* v = lval_alloc(LVAL_VEC);
+    lvec_init(&v->vec);
+    return v;
+}
+
+/* Create a vector: (vec 1 2 3) */
+lval* builtin_vec(lenv* e, lval* a) {
+    lval* v = lval_vec();
+    for (int i = 0; i < a->count; i++) {
+        lvec_push(&v->vec, lval_retain(list_index(a->cell, i)));
+    }
+    lval_del(a);
+    return v;
+}
+
+#define LASSERT_INDEX(func, args, v, i) \
+    LASSERT(args, (i) >= 0 && (i) < (v)->vec.len, \
+            "Function '%s' passed index %lld, vector has %d elements.", \
+            func, (long long)(i), (v)->vec.len)
+
+/* Get an element: (vec-get v 0) */
+lval* builtin_vec_get(lenv* e, lval* a) {
+    LASSERT_NUM("vec-get", a, 2);
+    LASSERT_TYPE("vec-get", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-get", a, 1, LVAL_LONG);
+
+    lval* v = list_index(a->cell, 0);
+    int64_t i = ((lval*)list_index(a->cell, 1))->inum;
+    LASSERT_INDEX("vec-get", a, v, i);
+
+    lval* x = lval_retain(lvec_get(&v->vec, i));
+    lval_del(a);
+    return x;
+}
+
+/* Replace an element: (vec-set v 0 7) - returns the new vector, which
+   shares all but the path down to the element with the old one */
+lval* builtin_vec_set(lenv* e, lval* a) {
+    LASSERT_NUM("vec-set", a, 3);
+    LASSERT_TYPE("vec-set", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-set", a, 1, LVAL_LONG);
+
+    int64_t i = ((lval*)list_index(a->cell, 1))->inum;
+    LASSERT_INDEX("vec-set", a, (lval*)list_index(a->cell, 0), i);
+
+    lval* v = lval_unshare(lval_pop(a, 0));
+    lvec_set(&v->vec, i, lval_pop(a, 1));
+    lval_del(a);
+    return v;
+}
+
+/* Add an element at the end: (vec-push v 4) - returns the new vector */
+lval* builtin_vec_push(lenv* e, lval* a) {
+    LASSERT_NUM("vec-push", a, 2);
+    LASSERT_TYPE("vec-push", a, 0, LVAL_VEC);
+
+    lval* v = lval_unshare(lval_pop(a, 0));
+    lvec_push(&v->vec, lval_pop(a, 0));
+    lval_del(a);
+    return v;
+}
+
+/* Number of elements: (vec-len v) */
+lval* builtin_vec_len(lenv* e, lval* a) {
+    LASSERT_NUM("vec-len", a, 1);
+    LASSERT_TYPE("vec-len", a, 0, LVAL_VEC);
+
+    lval* n = lval_long(((lval*)list_index(a->cell, 0))->vec.len);
+    lval_del(a);
+    return n;
+}
+
+/* The elements as a Q-expression: (vec-list v) */
+lval* builtin_vec_list(lenv* e, lval* a) {
+    LASSERT_NUM("vec-list", a, 1);
+    LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+    lval* v = list_index(a->cell, 0);
+    lval* q = lval_qexpr();
+    list_reserve(q->cell, v->vec.len);
+    for (int i = 0; i < v->vec.len; i++) {
+        lval_add(q, lval_retain(lvec_get(&v->vec, i)));
+    }
+    lval_del(a);
+    return q;
+}
+
+/* Sets. Members are keys bound to true in the same table dicts use */
+
+lval* lval_set(void) {
+    lval* v = lval_alloc(LVAL_SET);
+    ltable_init(&v->table);
+    return v;
+}
+
+#define LASSERT_HASHABLE(func, args, start) \
+    for (int i_ = (start); i_ < (args)->count; i_++) { \
+        lval* x_ = list_index((args)->cell, i_); \
+        LASSERT(args, lval_hashable(x_), \
+                "Function '%s' cannot put a %s in a set.", func, ltype_name(x_->type)); \
+    }
+
+static void set_put(lval* s, lval* x) {
+    ltable_put(&s->table, lval_retain(x), lval_hash(x), lval_bool(1));
+}
+
+/* Create a set: (set-of 1 2 3) */
+lval* builtin_set_of(lenv* e, lval* a) {
+    LASSERT_HASHABLE("set-of", a, 0);
+    lval* s = lval_set();
+    for (int i = 0; i < a->count; i++) {
+        set_put(s, list_index(a->cell, i));
+    }
+    lval_del(a);
+    return s;
+}
+
+/* Add values: (set-add s 4) - returns the new set */
+lval* builtin_set_add(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'set-add' requires at least 1 argument");
+    LASSERT_TYPE("set-add", a, 0, LVAL_SET);
+    LASSERT_HASHABLE("set-add", a, 1);
+
+    lval* s = lval_unshare(lval_pop(a, 0));
+    for (int i = 0; i < a->count; i++) {
+        lval* x = list_index(a->cell, i);
+        if (!ltable_get(&s->table, x, lval_hash(x))) { set_put(s, x); }
+    }
+    lval_del(a);
+    return s;
+}
+
+/* Remove values: (set-del s 4) - returns the new set */
+lval* builtin_set_del(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1, "Function 'set-del' requires at least 1 argument");
+    LASSERT_TYPE("set-del", a, 0, LVAL_SET);
+
+    lval* s = lval_pop(a, 0);
+    for (int i = 0; i < a->count; i++) {
+        lval* x = list_index(a->cell, i);
+        if (!lval_hashable(x)) { continue; }
+        unsigned hash = lval_hash(x);
+        if (ltable_get(&s->table, x, hash)) {
+            s = lval_unshare(s);
+            ltable_remove(&s->table, x, hash);
+        }
+    }
+    lval_del(a);
+    return s;
+}
+
+/* Check membership: (set-contains s 2) */
+lval* builtin_set_contains(lenv* e, lval* a) {
+    LASSERT_NUM("set-contains", a, 2);
+    LASSERT_TYPE("set-contains", a, 0, LVAL_SET);
+
+    lval* s = list_index(a->cell, 0);
+    lval* x = list_index(a->cell, 1);
+    int found = lval_hashable(x) && ltable_get(&s->table, x, lval_hash(x));
+    lval_del(a);
+    return lval_bool(found);
+}
+
+/* The members as a Q-expression: (set-list s) */
+lval* builtin_set_list(lenv* e, lval* a) {
+    return dict_list(a, "set-list", LVAL_SET, dict_add_key);
+}
+
+/* check that every argument of a bulk operation is a set */
+#define LASSERT_SETS(func, args) \
+    LASSERT(args, (args)->count >= 1, "Function '%s' requires at least 1 argument", func); \
+    for (int i_ = 0; i_ < (args)->count; i_++) { LASSERT_TYPE(func, args, i_, LVAL_SET); }
+
+typedef struct set_op {
+    lval* other;        /* the set to check members against */
+    lval* result;
+    int keep;           /* keep members that are in other, or those that are not */
+} set_op;
+
+static int set_add_member(lval* x, lval* t, void* result) {
+    lval* s = result;
+    unsigned hash = lval_hash(x);
+    if (!ltable_get(&s->table, x, hash)) {
+        ltable_put(&s->table, lval_retain(x), hash, lval_bool(1));
+    }
+    return 1;
+}
+
+static int set_filter_member(lval* x, lval* t, void* arg) {
+    set_op* op = arg;
+    unsigned hash = lval_hash(x);
+    if ((ltable_get(&op->other->table, x, hash) != NULL) == op->keep) {
+        ltable_put(&op->result->table, lval_retain(x), hash, lval_bool(1));
+    }
+    return 1;
+}
+
+static int set_remove_member(lval* x, lval* t, void* result) {
+    lval* s = result;
+    ltable_remove(&s->table, x, lval_hash(x));
+    return 1;
+}
+
+/* Union: (union s1 s2 ...). the biggest set is kept and the
+   others' members added to it */
+lval* builtin_union(lenv* e, lval* a) {
+    LASSERT_SETS("union", a);
+    int big = 0;
+    for (int i = 1; i < a->count; i++) {
+        if (((lval*)list_index(a->cell, i))->table.count >
+            ((lval*)list_index(a->cell, big))->table.count) { big = i; }
+    }
+    lval* s = lval_unshare(lval_pop(a, big));
+    for (int i = 0; i < a->count; i++) {
+        ltable_traverse(&((lval*)list_index(a->cell, i))->table, set_add_member, s);
+    }
+    lval_del(a);
+    return s;
+}
+
+/* Intersection: (intersection s1 s2 ...). each step walks the smaller
+   of the two sets and looks its members up in the other */
+lval* builtin_intersection(lenv* e, lval* a) {
+    LASSERT_SETS("intersection", a);
+    lval* s = lval_pop(a, 0);
+    while (a->count > 0) {
+        lval* t = lval_pop(a, 0);
+        if (t->table.count < s->table.count) {
+            lval* x = s; s = t; t = x;
+        }
+        set_op op = { t, lval_set(), 1 };
+        ltable_traverse(&s->table, set_filter_member, &op);
+        lval_del(s);
+        lval_del(t);
+        s = op.result;
+    }
+    lval_del(a);
+    return s;
+}
+
+/* Difference: (difference s1 s2 ...). members of a small set are
+   removed from s1, a big one is checked against s1's members instead */
+lval* builtin_difference(lenv* e, lval* a) {
+    LASSERT_SETS("difference", a);
+    lval* s = lval_pop(a, 0);
+    while (a->count > 0) {
+        lval* t = lval_pop(a, 0);
+        if (t->table.count < s->table.count) {
+            s = lval_unshare(s);
+            ltable_traverse(&t->table, set_remove_member, s);
+        } else {
+            set_op op = { t, lval_set(), 0 };
+            ltable_traverse(&s->table, set_filter_member, &op);
+            lval_del(s);
+            s = op.result;
+        }
+        lval_del(t);
+    }
+    lval_del(a);
+    return s;
+}
+
 /* Fraction implementation */
 
 /* Greatest common divisor using Euclidean algorithm */
@@ -2484,11 +4028,9 @@ lval* lval_frac(long numer, long denom) {
         return lval_long(numer);
     }
 
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FRAC;
+    lval* v = lval_alloc(LVAL_FRAC);
     v->numer = numer;
     v->denom = denom;
-    count_inc(v->type);
     return v;
 }
 
@@ -2501,7 +4043,7 @@ lval* builtin_frac(lenv* e, lval* a) {
     lval* numer = lval_pop(a, 0);
     lval* denom = lval_pop(a, 0);
 
-    lval* result = lval_frac((long)numer->num, (long)denom->num);
+    lval* result = lval_frac((long)numer->inum, (long)denom->inum);
 
     lval_del(numer);
     lval_del(denom);
@@ -2563,7 +4105,7 @@ lval* builtin_random(lenv* e, lval* a) {
     if (count == 1) {
         LASSERT_TYPE("random", a, 0, LVAL_LONG);
         lval* max = lval_pop(a, 0);
-        long result = rand() % (long)max->num;
+        int64_t result = rand() % max->inum;
         lval_del(max);
         lval_del(a);
         return lval_long(result);
@@ -2572,7 +4114,7 @@ lval* builtin_random(lenv* e, lval* a) {
         LASSERT_TYPE("random", a, 1, LVAL_LONG);
         lval* min = lval_pop(a, 0);
         lval* max = lval_pop(a, 0);
-        long result = (long)min->num + (rand() % ((long)max->num - (long)min->num));
+        int64_t result = min->inum + (rand() % (max->inum - min->inum));
         lval_del(min);
         lval_del(max);
         lval_del(a);
@@ -2589,10 +4131,10 @@ lval* builtin_sleep_ms(lenv* e, lval* a) {
     LASSERT_TYPE("sleep-ms", a, 0, LVAL_LONG);
 
     lval* ms = lval_pop(a, 0);
-    usleep((useconds_t)((long)ms->num * 1000));
+    usleep((useconds_t)(ms->inum * 1000));
     lval_del(ms);
     lval_del(a);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Enter terminal raw mode: (term-raw) */
@@ -2600,12 +4142,12 @@ lval* builtin_term_raw(lenv* e, lval* a) {
     lval_del(a);
 
     if (term_raw_mode) {
-        return lval_sexpr();
+        return lval_nil();
     }
 
     /* Check if stdin is a TTY before trying to set raw mode */
     if (!isatty(STDIN_FILENO)) {
-        return lval_sexpr();  /* Silently succeed if not a TTY */
+        return lval_nil();  /* Silently succeed if not a TTY */
     }
 
     if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) {
@@ -2622,7 +4164,7 @@ lval* builtin_term_raw(lenv* e, lval* a) {
     }
 
     term_raw_mode = 1;
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Restore terminal to normal mode: (term-restore) */
@@ -2630,12 +4172,12 @@ lval* builtin_term_restore(lenv* e, lval* a) {
     lval_del(a);
 
     if (!term_raw_mode) {
-        return lval_sexpr();
+        return lval_nil();
     }
 
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
     term_raw_mode = 0;
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Get key (non-blocking): (getkey) returns key code or -1 */
@@ -2665,7 +4207,7 @@ lval* builtin_clear(lenv* e, lval* a) {
     lval_del(a);
     printf("\033[2J\033[H");
     fflush(stdout);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Move cursor: (cursor row col) */
@@ -2677,13 +4219,13 @@ lval* builtin_cursor(lenv* e, lval* a) {
     lval* row = lval_pop(a, 0);
     lval* col = lval_pop(a, 0);
 
-    printf("\033[%ld;%ldH", (long)row->num, (long)col->num);
+    printf("\033[%lld;%lldH", (long long)row->inum, (long long)col->inum);
     fflush(stdout);
 
     lval_del(row);
     lval_del(col);
     lval_del(a);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Hide cursor: (cursor-hide) */
@@ -2691,7 +4233,7 @@ lval* builtin_cursor_hide(lenv* e, lval* a) {
     lval_del(a);
     printf("\033[?25l");
     fflush(stdout);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Show cursor: (cursor-show) */
@@ -2699,7 +4241,7 @@ lval* builtin_cursor_show(lenv* e, lval* a) {
     lval_del(a);
     printf("\033[?25h");
     fflush(stdout);
-    return lval_sexpr();
+    return lval_nil();
 }
 
 /* Modulo operation: (mod a b) */
@@ -2711,14 +4253,15 @@ lval* builtin_mod(lenv* e, lval* a) {
     lval* x = lval_pop(a, 0);
     lval* y = lval_pop(a, 0);
 
-    if ((long)y->num == 0) {
+    if (y->inum == 0) {
         lval_del(x);
         lval_del(y);
         lval_del(a);
         return lval_err("Division by zero");
     }
 
-    long result = (long)x->num % (long)y->num;
+    // INT64_MIN % -1 traps, though the remainder is 0
+    int64_t result = y->inum == -1 ? 0 : x->inum % y->inum;
     lval_del(x);
     lval_del(y);
     lval_del(a);
@@ -2730,7 +4273,7 @@ lval* builtin_time_ms(lenv* e, lval* a) {
     lval_del(a);
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    long ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    int64_t ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
     return lval_long(ms);
 }
 
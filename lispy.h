@@ -1,12 +1,16 @@
 #ifndef LISPY_H
 #define LISPY_H
-#include <strhash.h>
+#include <stdint.h>
 #include "mpc.h"
 #include "list.h"
+#include "symtab.h"
+#include "dict.h"
+#include "vec.h"
 
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 /* Length-prefixed string structure */
@@ -26,35 +30,69 @@ int   lstr_cmp(lstr* a, lstr* b);
 
 struct lval {
     int type;
-    float num;
+    /* number of owners; values with refs > 1 are shared and must be
+       unshared (copy-on-write) before being mutated */
+    int refs;
+    /* the payload, only the members for this type are valid */
+    union {
+        int64_t inum;         /* exact integer (LVAL_LONG) */
+        double num;           /* float and boolean (LVAL_FLOAT, LVAL_BOOL) */
 
-    /* fraction representation */
-    long numer;           /* numerator */
-    long denom;           /* denominator */
+        /* fraction representation (LVAL_FRAC) */
+        struct {
+            long numer;       /* numerator */
+            long denom;       /* denominator */
+        };
 
-    /* error and symbol have some string data */
-    char* str;
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
+        /* error and symbol have some string data (LVAL_STR, LVAL_ERR, LVAL_SYM).
+           symbol names are interned, equal symbols share str and its hash */
+        struct {
+            char* str;
+            unsigned hash;    /* LVAL_SYM only */
+        };
 
-    /* documentation string for builtins */
-    char* doc;
+        /* functions (LVAL_FUN), builtins only use builtin and doc */
+        struct {
+            lbuiltin builtin;
+            char* doc;        /* documentation string for builtins */
+            lenv* env;
+            lval* formals;
+            lval* body;
+            lcode* code;      /* body compiled for the VM, shared between copies */
+        };
 
-    /* count and pointer to a list of lval* */
-    int count;
-    list_t* cell;
+        /* count and pointer to a list of lval* (LVAL_SEXPR, LVAL_QEXPR) */
+        struct {
+            int count;
+            list_t* cell;
+        };
+
+        /* user-defined types (LVAL_UTYPE, LVAL_UVAL) */
+        struct {
+            char* type_name;  /* name of the user-defined type */
+            lval* fields;     /* field names (for type definition) or values (for instance) */
+        };
+
+        /* key to value table (LVAL_DICT), or members bound to true (LVAL_SET) */
+        ltable table;
 
-    /* user-defined type fields */
-    char* type_name;      /* name of the user-defined type */
-    lval* fields;         /* field names (for type definition) or values (for instance) */
+        /* persistent vector (LVAL_VEC) */
+        lvec vec;
+    };
 };
 
 struct lenv {
+    /* functions share their env until a call binds into it */
+    int refs;
     lenv* par;
     int count;
-    hash_table* syms;
+    symtab syms;
+    /* a call frame keeps its lambda's formals in slots, in order, so
+       compiled code can reach them by index. anything else bound in
+       the frame goes in syms. globals are not frames and have no slots */
+    int frame;
+    int nslots;
+    symtab_entry* slots;
 };
 // forward delcare parser names
 mpc_parser_t*   Number;
@@ -78,18 +116,24 @@ mpc_parser_t*   Lispy;
 
 lval* lval_eval_sexpr(lenv*, lval*);
 lval* lval_eval(lenv*, lval*);
-lval* lval_long(long);
+lval* lval_sexpr_value(lval*);
+lval* lval_long(int64_t);
 lval* lval_str(char*);
+lval* lval_str_take(char*);
 lval* lval_bool(int);
 lval* lval_err(char*, ...);
 lval* lval_sym(char*);
+lval* lval_symn(const char*, size_t);
 lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_nil(void);
 lval* lval_pop(lval*, int);
 lval* lval_take(lval*, int);
 lval* lval_eq(lval*, lval*);
 lval* lval_to_str(lval*);
 
-lval* builtin_op(lenv*, lval*, char*);
+lval* builtin_op(lenv*, lval*, int);
+lval* builtin_cmp(lenv*, lval*, int);
 lval* builtin_add(lenv*, lval*);
 lval* builtin_sub(lenv*, lval*);
 lval* builtin_mul(lenv*, lval*);
@@ -99,6 +143,14 @@ lval* builtin_tail(lenv*, lval*);
 lval* builtin_list(lenv*, lval*);
 lval* builtin_eval(lenv*, lval*);
 lval* builtin_join(lenv*, lval*);
+lval* builtin_map(lenv*, lval*);
+lval* builtin_filter(lenv*, lval*);
+lval* builtin_foldl(lenv*, lval*);
+lval* builtin_foldr(lenv*, lval*);
+lval* builtin_range(lenv*, lval*);
+lval* builtin_reverse(lenv*, lval*);
+lval* builtin_nth(lenv*, lval*);
+lval* builtin_len(lenv*, lval*);
 lval* builtin_def(lenv*, lval*);
 lval* builtin_lambda(lenv*, lval*);
 lval* builtin_var(lenv*, lval*, char*);
@@ -108,6 +160,7 @@ lval* builtin_put(lenv*, lval*);
 lval* bool_negate_expr(lval*);
 lval* bool_negate_val(lval*);
 lval* builtin_if(lenv*, lval*);
+lval* lval_if_branch(lenv*, lval*);
 lval* builtin_not(lenv*, lval*);
 lval* builtin_and(lenv*, lval*);
 lval* builtin_or(lenv*, lval*);
@@ -120,7 +173,7 @@ lval* builtin_ge(lenv*, lval*);
 lval* builtin_le(lenv*, lval*);
 
 //string ops
-lval* builtin_str_op(lenv*, lval*, char*);
+lval* builtin_str_op(lenv*, lval*);
 lval* builtin_str(lenv*, lval*);
 lval* builtin_strlen(lenv*, lval*);
 
@@ -131,6 +184,9 @@ lval* builtin_bool_cast(lenv*, lval*);
 
 // file loading
 lval* builtin_load(lenv* e, lval* a);
+lval* builtin_compile(lenv* e, lval* a);
+lval* builtin_save_image(lenv* e, lval* a);
+lval* lenv_restore(lenv* e, const char* path);
 
 // printing
 lval* builtin_print(lenv* e, lval* a);
@@ -146,15 +202,25 @@ lval* lval_eval_debug(lenv* e, lval* v, int depth);
 // threads
 lval* builtin_spawn(lenv* e, lval* a);
 lval* builtin_wait(lenv* e, lval* a);
+lval* builtin_pmap(lenv* e, lval* a);
+lval* builtin_gc(lenv* e, lval* a);
+
+/* collector */
+int lval_gc(lenv* e);
+int lthread_roots(void (*env)(void*, lenv*), void (*val)(void*, lval*), void* arg);
+extern int gc_requested;
 
 lval* lval_join(lval*, lval*);
 lval* lval_copy(lval*);
+lval* lval_retain(lval*);
+lval* lval_unshare(lval*);
 void  lval_del(lval*);
 lval* lval_call(lenv*, lval*, lval*);
+lval* lval_bind(lenv*, lval*, lval*);
 
 lval* lval_add(lval*, lval*);
 lval* lval_read_num(mpc_ast_t*);
-lval* lval_float(float);
+lval* lval_float(double);
 lval* lval_read(mpc_ast_t*);
 lval* lval_read_bool(mpc_ast_t*);
 lval* lval_read_str(mpc_ast_t*);
@@ -165,16 +231,21 @@ void lval_println(lval*);
 
 /* lenv stuff */
 lenv* lenv_new(void);
+lenv* lenv_frame(lval* formals);
 void  lenv_del(lenv*);
+lenv* lenv_retain(lenv*);
+lenv* lenv_unshare(lenv*);
 lval* lenv_get(lenv*, lval*);
+lval* lenv_lookup(lenv*, char*, unsigned);
 void  lenv_put(lenv*, lval*, lval*);
 void lenv_add_builtin(lenv*, char*, lbuiltin, char*);
 void lenv_add_builtins(lenv*);
 lenv* lenv_copy(lenv* e);
+lenv* lenv_snapshot(lenv* e);
+void  lenv_snapshot_del(lenv* e);
 void lenv_def(lenv*, lval*, lval*);
-void lenv_hash_purge(char*, lval*);
+void lenv_absorb(lenv*, lenv*);
 int  lenv_hash_print_keys(char*, lval*, void*);
-int  lenv_hash_copy_kv(char*, lval*, hash_table*);
 
 /* enum -> name */
 char* ltype_name(int t);
@@ -182,6 +253,7 @@ char* ltype_name(int t);
 /* global counters (for debugging) */
 extern int counter;
 extern int debug;
+extern int vm_enabled;
 
 /* lambda stuff */
 lval* lval_lambda(lval*, lval*);
@@ -194,6 +266,36 @@ lval* builtin_new(lenv* e, lval* a);
 lval* builtin_get(lenv* e, lval* a);
 lval* builtin_set(lenv* e, lval* a);
 
+/* dictionaries */
+lval* lval_dict(void);
+lval* builtin_dict(lenv* e, lval* a);
+lval* builtin_dict_get(lenv* e, lval* a);
+lval* builtin_dict_set(lenv* e, lval* a);
+lval* builtin_dict_del(lenv* e, lval* a);
+lval* builtin_dict_has(lenv* e, lval* a);
+lval* builtin_dict_keys(lenv* e, lval* a);
+lval* builtin_dict_items(lenv* e, lval* a);
+
+/* vectors */
+lval* lval_vec(void);
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_vec_get(lenv* e, lval* a);
+lval* builtin_vec_set(lenv* e, lval* a);
+lval* builtin_vec_push(lenv* e, lval* a);
+lval* builtin_vec_len(lenv* e, lval* a);
+lval* builtin_vec_list(lenv* e, lval* a);
+
+/* sets */
+lval* lval_set(void);
+lval* builtin_set_of(lenv* e, lval* a);
+lval* builtin_set_add(lenv* e, lval* a);
+lval* builtin_set_del(lenv* e, lval* a);
+lval* builtin_set_contains(lenv* e, lval* a);
+lval* builtin_set_list(lenv* e, lval* a);
+lval* builtin_union(lenv* e, lval* a);
+lval* builtin_intersection(lenv* e, lval* a);
+lval* builtin_difference(lenv* e, lval* a);
+
 /* fractions */
 lval* lval_frac(long numer, long denom);
 lval* builtin_frac(lenv* e, lval* a);
@@ -227,7 +329,24 @@ enum {
     LVAL_QEXPR, // 8
     LVAL_UTYPE, // 9  - user-defined type definition
     LVAL_UVAL,  // 10 - user-defined type instance
-    LVAL_FRAC   // 11 - fraction (rational number)
+    LVAL_FRAC,  // 11 - fraction (rational number)
+    LVAL_DICT,  // 12 - hash table from values to values
+    LVAL_VEC,   // 13 - persistent vector
+    LVAL_SET    // 14 - hash set of values
+};
+
+/* Operators handled by builtin_op and builtin_cmp */
+enum {
+    LOP_ADD,
+    LOP_SUB,
+    LOP_MUL,
+    LOP_DIV,
+    LOP_LT,
+    LOP_GT,
+    LOP_LE,
+    LOP_GE,
+    LOP_EQ,
+    LOP_NE
 };
 
 /* Possible error types */
@@ -1,139 +1,116 @@
 #include <stdlib.h>
+#include <string.h>
 #include "list.h"
 #include "lispy.h"
+#include "slab.h"
 
 struct lval;
 
+#define LIST_MIN_CAP 4
+
 list_t* list_init(void) {
-    list_t* l = malloc(sizeof(list_t));
+    list_t* l = slab_alloc(sizeof(list_t));
+    l->items = NULL;
+    l->start = 0;
     l->count = 0;
-    l->head = NULL;
+    l->cap = 0;
+    l->end = 0;
+    l->curr = 0;
     return l;
 }
 
-void list_push(list_t* head, void* val) {
-    // newly initialized list with no head node
-    if (head->head == NULL) {
-        head->head = malloc(sizeof(list_node));
-        head->head->val = val;
-        head->head->next = NULL;
-        head->head->prev = NULL;
-        head->count = 1;
+// make room for at least cap items after start
+void list_reserve(list_t* head, int cap) {
+    if (head->start + cap <= head->cap) {
         return;
     }
-    list_node* l = head->head;
-    list_node* p = NULL;
-
-    while (l->next != NULL) {
-        l = l->next;
+    // reclaim the space left at the front by removals first
+    if (head->start > 0) {
+        memmove(head->items, head->items + head->start, sizeof(void*) * head->count);
+        head->curr -= head->start;
+        head->start = 0;
+        if (cap <= head->cap) {
+            return;
+        }
+    }
+    int ncap = head->cap ? head->cap : LIST_MIN_CAP;
+    while (ncap < cap) {
+        ncap *= 2;
+    }
+    // small arrays come from the slab, so go through it to move them
+    void** items = slab_alloc(sizeof(void*) * ncap);
+    if (head->items) {
+        memcpy(items, head->items, sizeof(void*) * head->count);
+        slab_free(head->items, sizeof(void*) * head->cap);
     }
-    p = l;
+    head->items = items;
+    head->cap = ncap;
+}
 
-    l = malloc(sizeof(list_node));
-    l->prev = p;
-    p->next = l;
-    l->val = val;
-    l->next = NULL;
+void list_push(list_t* head, void* val) {
+    if (head->start + head->count == head->cap) {
+        // grow geometrically so appends are amortized O(1)
+        int want = head->count + 1;
+        if (head->start < head->cap / 2) {
+            want = head->cap ? head->cap * 2 : LIST_MIN_CAP;
+        }
+        list_reserve(head, want);
+    }
+    head->items[head->start + head->count] = val;
     head->count = head->count + 1;
 }
 
 void* list_pop(list_t* head) {
-    list_node* l = head->head;
-    if (l == NULL || head->count == 0) {
+    if (head->count == 0) {
         // not sure if I should be creating values here, may lead to
         // unfreed errors
         return NULL; //lval_err("Attempted to pop from empty list.");
     }
-    while (l->next != NULL) {
-    // while ((l != NULL) && (l->next != NULL)) {
-        l = l->next;
-    }
-    void* val = l->val;
-    
-    if (l->prev != NULL) {
-        l->prev->next = NULL;
-    }
     head->count = head->count - 1;
-    // why do I need to do this?
-    if (l == head->head) {
-        free(head->head);
-        head->head = NULL;
-        return val;
-    }
-    free(l);
-    l = NULL;
-    return val;
+    return head->items[head->start + head->count];
 }
 
 void* list_index(list_t* head, int index) {
-    if (index > head->count) {
+    if (index >= head->count) {
         return NULL; //lval_err("Index out of bounds: %d", index);
     }
-    list_node* l = head->head;
-    while (index > 0) {
-        l = l->next;
-        index--;
-    }
-    return l->val;
+    return head->items[head->start + index];
 }
 
 void list_remove(list_t* head, int index) {
-    list_node* l = head->head;
-    while (index > 0) {
-        l = l->next;
-        index--;
-    }
-    if (l == head->head) {
-        head->head = l->next;
-    }
-    if (l->prev != NULL) { 
-        l->prev->next = l->next;
-    }
-    if (l->next != NULL) {
-        l->next->prev = l->prev;
+    if (index == 0) {
+        head->start++;
+    } else {
+        void** at = head->items + head->start + index;
+        memmove(at, at + 1, sizeof(void*) * (head->count - index - 1));
     }
     head->count = head->count - 1;
-    free(l);
+    if (head->count == 0) {
+        head->start = 0;
+    }
 }
 
 void list_destroy(list_t* head) {
-    list_node* l = head->head;
-    list_node* n = NULL;
-    if (l != NULL) {
-        n = l->next;
+    if (head->items) {
+        slab_free(head->items, sizeof(void*) * head->cap);
     }
-
-    while (l != NULL) {
-        free(l);
-        l = NULL;
-        if (n == NULL) {
-            break;
-        }
-        l = n;
-        n = l->next;
-    }
-    head->count = 0;
+    slab_free(head, sizeof(list_t));
 }
 
 void list_replace(list_t* head, int index, void* v) {
-    list_node* l = head->head;
-    while (index > 0) {
-        l = l->next;
-        index--;
-    }
-    l->val = v;
+    head->items[head->start + index] = v;
 }
 
 // iteration
 void* list_start(list_t* head) {
     head->end = 1;
+    head->curr = head->start;
     // TODO: don't include this
-    if (head->head == NULL || ((struct lval*)head->head->val)->type == LVAL_ERR) {
+    if (head->count == 0 || ((struct lval*)head->items[head->start])->type == LVAL_ERR) {
         head->end = 0;
         return NULL;
     }
-    head->curr = head->head;
-    return head->curr->val;
+    return head->items[head->curr];
 }
 
 int list_end(list_t* head) {
@@ -141,24 +118,24 @@ int list_end(list_t* head) {
 }
 
 void* list_iter(list_t* head) {
-    if (head->curr->next == NULL) {
+    if (head->curr + 1 >= head->start + head->count) {
         head->end = 0;
         // shouldn't actually be used.
         return NULL;
     }
-    head->curr = head->curr->next;
-    return head->curr->val;
+    head->curr++;
+    return head->items[head->curr];
 }
 
 void* list_curr(list_t* head) {
-    if (head->curr == NULL) {
+    if (head->count == 0) {
         return NULL;
     }
-    return head->curr->val;
+    return head->items[head->curr];
 }
 
 void list_replace_curr(list_t* head, void* val) {
-    if (head->curr != NULL) {
-        head->curr->val = val;
+    if (head->count != 0) {
+        head->items[head->curr] = val;
     }
 }
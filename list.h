@@ -1,20 +1,20 @@
 #ifndef LVAL_LIST_H
 #define LVAL_LIST_H
 
-typedef struct list_node {
-    void* val;
-    struct list_node* next;
-    struct list_node* prev;
-} list_node;
-
+/* contiguous growable array of pointers. live items are
+   items[start] .. items[start + count - 1], so removing from the
+   front only moves start instead of shifting the whole array */
 typedef struct list_t {
-    list_node* head;
+    void** items;
+    int start;
     int count;
+    int cap;
     int end;
-    list_node* curr;
+    int curr;
 } list_t;
 
 list_t*      list_init(void);
+void         list_reserve(list_t* head, int cap);
 void         list_push(list_t* head, void* val);
 void* list_pop(list_t* head);
 void* list_index(list_t* head, int index);
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.h"
+
+typedef struct task {
+    pool_fn fn;
+    void* arg;
+    struct task* next;
+} task;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* workers sleep on pool_work until a task is queued. threads in
+   pool_wait sleep on pool_finished, which is signalled when a pending
+   count drops or a task is queued they could run */
+static pthread_cond_t  pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  pool_finished = PTHREAD_COND_INITIALIZER;
+static task* queue_head = NULL;
+static task* queue_tail = NULL;
+static int workers = 0;
+static int waiting = 0;     /* threads in pool_wait, who also run tasks */
+
+/* take the next task, the caller holds pool_mutex */
+static task* pool_take(void) {
+    task* t = queue_head;
+    if (t) {
+        queue_head = t->next;
+        if (queue_head == NULL) { queue_tail = NULL; }
+    }
+    return t;
+}
+
+static void* pool_worker(void* unused) {
+    pthread_mutex_lock(&pool_mutex);
+    for (;;) {
+        task* t = pool_take();
+        if (t == NULL) {
+            pthread_cond_wait(&pool_work, &pool_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        t->fn(t->arg);
+        free(t);
+        pthread_mutex_lock(&pool_mutex);
+    }
+    return NULL;
+}
+
+/* start the workers, the caller holds pool_mutex */
+static void pool_start(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) { n = 1; }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, pool_worker, NULL) == 0) { workers++; }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+int pool_size(void) {
+    pthread_mutex_lock(&pool_mutex);
+    if (workers == 0) { pool_start(); }
+    int n = workers;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+void pool_submit(pool_fn fn, void* arg) {
+    task* t = malloc(sizeof(task));
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (workers == 0) { pool_start(); }
+    if (queue_tail) {
+        queue_tail->next = t;
+    } else {
+        queue_head = t;
+    }
+    queue_tail = t;
+    pthread_cond_signal(&pool_work);
+    if (waiting) { pthread_cond_broadcast(&pool_finished); }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_done(int* pending) {
+    pthread_mutex_lock(&pool_mutex);
+    (*pending)--;
+    pthread_cond_broadcast(&pool_finished);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_wait(int* pending) {
+    pthread_mutex_lock(&pool_mutex);
+    while (*pending > 0) {
+        task* t = pool_take();
+        if (t == NULL) {
+            waiting++;
+            pthread_cond_wait(&pool_finished, &pool_mutex);
+            waiting--;
+            continue;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        t->fn(t->arg);
+        free(t);
+        pthread_mutex_lock(&pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
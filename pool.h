@@ -0,0 +1,20 @@
+#ifndef LISPY_POOL_H
+#define LISPY_POOL_H
+
+/* A fixed set of worker threads, one per core, started the first
+   time work is submitted and kept for the life of the program. Tasks
+   are taken from a shared queue in the order they were submitted */
+
+typedef void (*pool_fn)(void*);
+
+int  pool_size(void);
+void pool_submit(pool_fn fn, void* arg);
+
+/* a task reports it has finished by decrementing a pending count
+   with pool_done. pool_wait blocks until the count reaches zero,
+   running queued tasks itself meanwhile, so a task may wait on
+   tasks it submitted without starving the pool */
+void pool_done(int* pending);
+void pool_wait(int* pending);
+
+#endif
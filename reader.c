@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "lispy.h"
+#include "reader.h"
+
+/* The grammar this follows, from main:
+
+     number  : -?[0-9]+(\.[0-9]+)?
+     bool    : true|false
+     string  : "(\\.|[^"])*"
+     symbol  : [a-zA-Z0-9_+\-*\/\\=<>!&]+
+     comment : ;[^\r\n]*
+     expr    : number | bool | comment | string | symbol | sexpr | qexpr
+
+   The alternatives are tried in that order and each takes as much as it
+   can without looking further, so "12ab" is a number then a symbol and
+   "trueish" is true then "ish", just as mpc reads them */
+
+static int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int is_symbol(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c)
+        || (c != '\0' && strchr("_+-*/\\=<>!&", c) != NULL);
+}
+
+void reader_init(reader* r, const char* name, const char* src, size_t len) {
+    r->name = name;
+    r->p = src;
+    r->end = src + len;
+    r->line_start = src;
+    r->line = 1;
+    r->col_base = 0;
+    r->more = 0;
+    r->err = NULL;
+}
+
+void reader_feed(reader* r, const char* src, size_t len, int more) {
+    r->col_base += (int)(r->p - r->line_start);
+    r->p = src;
+    r->end = src + len;
+    r->line_start = src;
+    r->more = more;
+}
+
+static void reader_error(reader* r, const char* what) {
+    r->err = lval_err("%s:%d:%d: error: %s", r->name, r->line,
+                      r->col_base + (int)(r->p - r->line_start) + 1, what);
+}
+
+/* whitespace and comments */
+static void skip_space(reader* r) {
+    while (r->p < r->end) {
+        char c = *r->p;
+        if (c == '\n') {
+            r->line++;
+            r->line_start = ++r->p;
+            r->col_base = 0;
+        } else if (is_space(c)) {
+            r->p++;
+        } else if (c == ';') {
+            while (r->p < r->end && *r->p != '\n' && *r->p != '\r') { r->p++; }
+        } else {
+            break;
+        }
+    }
+}
+
+static int starts_with(reader* r, const char* s, size_t n) {
+    return (size_t)(r->end - r->p) >= n && memcmp(r->p, s, n) == 0;
+}
+
+static lval* read_number(reader* r) {
+    const char* s = r->p;
+    int dot = 0;
+    if (*r->p == '-') { r->p++; }
+    while (r->p < r->end && is_digit(*r->p)) { r->p++; }
+    // whether "1." is a float can't be told at the end of the buffer
+    if (r->more && r->end - r->p < 2) { return NULL; }
+    if (r->end - r->p >= 2 && r->p[0] == '.' && is_digit(r->p[1])) {
+        dot = 1;
+        r->p++;
+        while (r->p < r->end && is_digit(*r->p)) { r->p++; }
+    }
+
+    /* strtod and strtoll want a NUL at the end */
+    size_t len = r->p - s;
+    char buf[64];
+    char* text = len < sizeof(buf) ? buf : malloc(len + 1);
+    memcpy(text, s, len);
+    text[len] = '\0';
+
+    lval* v;
+    errno = 0;
+    if (dot) {
+        double f = strtod(text, NULL);
+        v = errno != ERANGE ? lval_float(f) : lval_err("Invalid Float");
+    } else {
+        int64_t x = strtoll(text, NULL, 10);
+        v = errno != ERANGE ? lval_long(x) : lval_err("invalid number");
+    }
+    if (text != buf) { free(text); }
+    return v;
+}
+
+/* escapes mpcf_unescape knows. \0 ends the C string it builds up, so
+   it drops out rather than cutting the string short */
+static int unescape(char c, char* out) {
+    switch (c) {
+        case 'a':  *out = '\a'; return 1;
+        case 'b':  *out = '\b'; return 1;
+        case 'f':  *out = '\f'; return 1;
+        case 'n':  *out = '\n'; return 1;
+        case 'r':  *out = '\r'; return 1;
+        case 't':  *out = '\t'; return 1;
+        case 'v':  *out = '\v'; return 1;
+        case '\\': *out = '\\'; return 1;
+        case '\'': *out = '\''; return 1;
+        case '"':  *out = '"';  return 1;
+        case '0':  *out = '\0'; return 1;
+    }
+    return 0;
+}
+
+static lval* read_string(reader* r) {
+    reader open = *r;
+    const char* s = ++r->p;
+    while (r->p < r->end && *r->p != '"') {
+        if (*r->p == '\\' && r->p + 1 < r->end) { r->p++; }
+        if (*r->p == '\n') {
+            r->line++;
+            r->line_start = r->p + 1;
+            r->col_base = 0;
+        }
+        r->p++;
+    }
+    if (r->p >= r->end) {
+        *r = open;
+        if (!r->more) { reader_error(r, "unterminated string"); }
+        return NULL;
+    }
+
+    size_t len = r->p - s;
+    char* str = malloc(len + 1);
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c;
+        if (s[i] == '\\' && i + 1 < len && unescape(s[i + 1], &c)) {
+            i++;
+            if (c == '\0') { continue; }
+            str[n++] = c;
+        } else {
+            str[n++] = s[i];
+        }
+    }
+    str[n] = '\0';
+    r->p++;
+    return lval_str_take(str);
+}
+
+static lval* read_expr(reader* r);
+
+static lval* read_list(reader* r, char close) {
+    lval* x = close == ')' ? lval_sexpr() : lval_qexpr();
+    r->p++;
+    for (;;) {
+        skip_space(r);
+        if (r->p >= r->end) {
+            if (!r->more) {
+                reader_error(r, close == ')' ? "expected ')' before end of input"
+                                             : "expected '}' before end of input");
+            }
+            lval_del(x);
+            return NULL;
+        }
+        if (*r->p == close) {
+            r->p++;
+            return x;
+        }
+        lval* y = read_expr(r);
+        if (y == NULL) {
+            lval_del(x);
+            return NULL;
+        }
+        lval_add(x, y);
+    }
+}
+
+static lval* read_expr(reader* r) {
+    char c = *r->p;
+    if (is_digit(c) || (c == '-' && r->p + 1 < r->end && is_digit(r->p[1]))) {
+        return read_number(r);
+    }
+    if (starts_with(r, "true", 4))  { r->p += 4; return lval_bool(1); }
+    if (starts_with(r, "false", 5)) { r->p += 5; return lval_bool(0); }
+    if (c == '"') { return read_string(r); }
+    if (is_symbol(c)) {
+        const char* s = r->p;
+        while (r->p < r->end && is_symbol(*r->p)) { r->p++; }
+        return lval_symn(s, r->p - s);
+    }
+    if (c == '(') { return read_list(r, ')'); }
+    if (c == '{') { return read_list(r, '}'); }
+
+    char what[32];
+    if (c > ' ' && c < 0x7f) {
+        snprintf(what, sizeof(what), "unexpected '%c'", c);
+    } else {
+        snprintf(what, sizeof(what), "unexpected character 0x%02x", (unsigned char)c);
+    }
+    reader_error(r, what);
+    return NULL;
+}
+
+lval* reader_next(reader* r) {
+    if (r->err) { return NULL; }
+    reader start = *r;
+    skip_space(r);
+    if (r->p >= r->end) {
+        // a comment may carry on past the buffer
+        if (r->more) { *r = start; }
+        return NULL;
+    }
+    lval* x = read_expr(r);
+
+    /* with more to come, a form that reached the end of the buffer may
+       have been cut short, a number or symbol especially, so it is read
+       again once there is more */
+    if (r->more && r->err == NULL && (x == NULL || r->p >= r->end)) {
+        if (x) { lval_del(x); }
+        *r = start;
+        return NULL;
+    }
+    return x;
+}
+
+lval* read_forms(const char* name, const char* src, size_t len, lval** err) {
+    reader r;
+    reader_init(&r, name, src, len);
+    lval* x = lval_sexpr();
+    lval* y;
+    while ((y = reader_next(&r))) {
+        lval_add(x, y);
+    }
+    if (r.err) {
+        lval_del(x);
+        *err = r.err;
+        return NULL;
+    }
+    return x;
+}
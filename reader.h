@@ -0,0 +1,35 @@
+#ifndef LISPY_READER_H
+#define LISPY_READER_H
+
+#include <stddef.h>
+
+struct lval;
+
+/* A reader for the lispy grammar that builds values straight from the
+   source bytes in one pass, rather than an mpc AST to be walked again.
+   It reads what the grammar in main reads, token for token, and the
+   source need not end in a NUL */
+typedef struct reader {
+    const char* name;
+    const char* p;
+    const char* end;
+    const char* line_start;
+    int line;
+    int col_base;           /* columns of the current line before line_start */
+    int more;               /* the buffer is not the end of the input */
+    struct lval* err;       /* set on a syntax error, the reader stops there */
+} reader;
+
+void reader_init(reader* r, const char* name, const char* src, size_t len);
+/* the next top level form, or NULL if there is none or on a syntax
+   error, which leaves r->err for the caller to take. While r->more is
+   set, NULL without an error means the buffer ran out first: r->p is
+   left where the unfinished form starts, for reader_feed */
+struct lval* reader_next(reader* r);
+/* carry on from src, which starts with what r had not read yet */
+void reader_feed(reader* r, const char* src, size_t len, int more);
+/* all of src as one S-expression, the way lval_read returns a parse.
+   NULL with *err set on a syntax error */
+struct lval* read_forms(const char* name, const char* src, size_t len, struct lval** err);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+
+#ifdef SLAB_DISABLE
+
+void* slab_alloc(size_t size) { return malloc(size); }
+void  slab_free(void* p, size_t size) { free(p); }
+void  slab_thread_exit(void) {}
+void* slab_pool_alloc(size_t size) { return malloc(size); }
+void  slab_pool_free(void* p, size_t size) { free(p); }
+/* without the slab the objects can't be found, so there is nothing to walk */
+void  slab_pool_walk(size_t size, void (*fn)(void*, void*), void* arg) {}
+void  slab_pool_usage(int* free, int* used, int* count) { *free = *used = *count = 0; }
+
+#else
+
+#define SLAB_ALIGN   16
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_ALIGN)
+#define SLAB_CHUNK   16384
+
+typedef struct slab_obj {
+    struct slab_obj* next;
+} slab_obj;
+
+/* free objects of each size class owned by this thread */
+static __thread slab_obj* free_lists[SLAB_CLASSES];
+
+/* free lists handed back by threads that have finished */
+static slab_obj* orphans[SLAB_CLASSES];
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int slab_class(size_t size) {
+    return (int)((size + SLAB_ALIGN - 1) / SLAB_ALIGN) - 1;
+}
+
+/* refill a thread's free list, from a finished thread if possible,
+   otherwise by carving up a fresh chunk */
+static slab_obj* slab_refill(int c) {
+    pthread_mutex_lock(&orphans_mutex);
+    slab_obj* o = orphans[c];
+    orphans[c] = NULL;
+    pthread_mutex_unlock(&orphans_mutex);
+    if (o) { return o; }
+
+    size_t size = (size_t)(c + 1) * SLAB_ALIGN;
+    int n = SLAB_CHUNK / size;
+    char* chunk = malloc(n * size);
+    for (int i = 0; i < n - 1; i++) {
+        ((slab_obj*)(chunk + i * size))->next = (slab_obj*)(chunk + (i + 1) * size);
+    }
+    ((slab_obj*)(chunk + (n - 1) * size))->next = NULL;
+    return (slab_obj*)chunk;
+}
+
+void* slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) { return malloc(size); }
+    int c = slab_class(size);
+    slab_obj* o = free_lists[c];
+    if (o == NULL) { o = slab_refill(c); }
+    free_lists[c] = o->next;
+    return o;
+}
+
+/* Pool. A free object holds SLAB_FREE in its first word and the link
+   in its second, so a walk can tell free objects from live ones.
+
+   Freed objects go on the thread's free list and are reused first,
+   most recently freed first. Only when that is empty is a new object
+   carved from the thread's current chunk, by taking the next one of
+   its objects. A chunk is not threaded onto the free list when it is
+   allocated, so its objects aren't touched until they are first
+   handed out, and a walk only looks at the ones that have been */
+
+typedef struct slab_pool_obj {
+    unsigned free;
+    struct slab_pool_obj* next;
+} slab_pool_obj;
+
+typedef struct slab_chunk {
+    struct slab_chunk* next;
+    int size;
+    int count;
+    int used;       /* objects handed out so far, the rest are untouched */
+} slab_chunk;
+
+#define SLAB_CHUNK_HDR ((sizeof(slab_chunk) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+
+static __thread slab_pool_obj* pool_free_list;
+static __thread slab_chunk* carving;  /* the chunk new objects come from */
+static slab_pool_obj* pool_orphans;
+static slab_chunk* pool_chunks = NULL;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t pool_size(size_t size) {
+    return (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+}
+
+static char* pool_object(slab_chunk* k, size_t size, int i) {
+    return (char*)k + SLAB_CHUNK_HDR + i * size;
+}
+
+/* the free list is empty and the chunk being carved is used up. take
+   a finished thread's free objects if there are any, otherwise start
+   carving a new chunk */
+static slab_pool_obj* pool_refill(size_t size) {
+    pthread_mutex_lock(&orphans_mutex);
+    slab_pool_obj* o = pool_orphans;
+    pool_orphans = NULL;
+    pthread_mutex_unlock(&orphans_mutex);
+    if (o) { return o; }
+
+    int n = (SLAB_CHUNK - SLAB_CHUNK_HDR) / size;
+    slab_chunk* k = malloc(SLAB_CHUNK_HDR + n * size);
+    k->size = size;
+    k->count = n;
+    k->used = 0;
+    pthread_mutex_lock(&pool_mutex);
+    k->next = pool_chunks;
+    pool_chunks = k;
+    pthread_mutex_unlock(&pool_mutex);
+    carving = k;
+    return NULL;
+}
+
+void* slab_pool_alloc(size_t size) {
+    slab_pool_obj* o = pool_free_list;
+    if (o) {
+        pool_free_list = o->next;
+    } else {
+        size = pool_size(size);
+        if (carving == NULL || carving->used == carving->count) {
+            o = pool_refill(size);
+        }
+        if (o) {
+            pool_free_list = o->next;
+        } else {
+            o = (slab_pool_obj*)pool_object(carving, size, carving->used++);
+        }
+    }
+    o->free = 0;
+    return o;
+}
+
+void slab_pool_free(void* p, size_t size) {
+    slab_pool_obj* o = p;
+    o->free = SLAB_FREE;
+    o->next = pool_free_list;
+    pool_free_list = o;
+}
+
+/* call fn on every live object. nothing may allocate from or free to
+   the pool while this runs */
+void slab_pool_walk(size_t size, void (*fn)(void*, void*), void* arg) {
+    size = pool_size(size);
+    pthread_mutex_lock(&pool_mutex);
+    for (slab_chunk* k = pool_chunks; k; k = k->next) {
+        for (int i = 0; i < k->used; i++) {
+            char* x = pool_object(k, size, i);
+            if (((slab_pool_obj*)x)->free != SLAB_FREE) { fn(x, arg); }
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void slab_pool_usage(int* free, int* used, int* count) {
+    *free = 0;
+    for (slab_pool_obj* o = pool_free_list; o; o = o->next) { (*free)++; }
+    pthread_mutex_lock(&orphans_mutex);
+    for (slab_pool_obj* o = pool_orphans; o; o = o->next) { (*free)++; }
+    pthread_mutex_unlock(&orphans_mutex);
+    *used = carving ? carving->used : 0;
+    *count = carving ? carving->count : 0;
+}
+
+void slab_free(void* p, size_t size) {
+    if (size > SLAB_MAX_SIZE) { free(p); return; }
+    int c = slab_class(size);
+    slab_obj* o = p;
+    o->next = free_lists[c];
+    free_lists[c] = o;
+}
+
+/* give this thread's free objects to whichever thread needs them next */
+void slab_thread_exit(void) {
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        slab_obj* o = free_lists[c];
+        if (o == NULL) { continue; }
+        slab_obj* last = o;
+        while (last->next) { last = last->next; }
+        pthread_mutex_lock(&orphans_mutex);
+        last->next = orphans[c];
+        orphans[c] = o;
+        pthread_mutex_unlock(&orphans_mutex);
+        free_lists[c] = NULL;
+    }
+
+    /* what is left of the chunk joins the free objects */
+    if (carving) {
+        while (carving->used < carving->count) {
+            slab_pool_free(pool_object(carving, carving->size, carving->used++), carving->size);
+        }
+        carving = NULL;
+    }
+
+    slab_pool_obj* o = pool_free_list;
+    if (o == NULL) { return; }
+    slab_pool_obj* last = o;
+    while (last->next) { last = last->next; }
+    pthread_mutex_lock(&orphans_mutex);
+    last->next = pool_orphans;
+    pool_orphans = o;
+    pthread_mutex_unlock(&orphans_mutex);
+    pool_free_list = NULL;
+}
+
+#endif
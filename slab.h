@@ -0,0 +1,29 @@
+#ifndef LISPY_SLAB_H
+#define LISPY_SLAB_H
+#include <stddef.h>
+
+/* size-classed allocator for the small objects the evaluator churns
+   through. each thread keeps its own free lists, so the common path
+   takes no lock. objects larger than SLAB_MAX_SIZE go to malloc.
+   build with -DSLAB_DISABLE to use malloc for everything */
+#define SLAB_MAX_SIZE 256
+
+void* slab_alloc(size_t size);
+void  slab_free(void* p, size_t size);
+void  slab_thread_exit(void);
+
+/* a pool kept apart from the size classes for one kind of object,
+   whose chunks are remembered so the collector can visit every live
+   object. callers always pass the same size, at least 16 bytes, and
+   a live object must never start with SLAB_FREE */
+#define SLAB_FREE 0x5ee1f4eeu
+void* slab_pool_alloc(size_t size);
+void  slab_pool_free(void* p, size_t size);
+void  slab_pool_walk(size_t size, void (*fn)(void*, void*), void* arg);
+/* for tests and debugging: the free objects this thread would reuse
+   before carving any more, counting those left by finished threads,
+   and how many objects of its current chunk have been carved so far
+   out of how many it holds */
+void  slab_pool_usage(int* free, int* used, int* count);
+
+#endif
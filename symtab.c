@@ -0,0 +1,171 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "symtab.h"
+
+/* FNV-1a */
+static unsigned hash_str(const char* s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Interning. Names live for the rest of the program, the table is
+   shared by all threads so it is guarded by a mutex. Each name is
+   stored after a small header holding what we know about it */
+
+typedef struct intern_hdr {
+    unsigned hash;
+    int local;          /* has ever been bound in a call frame */
+    char name[];
+} intern_hdr;
+
+typedef struct intern_entry {
+    char* name;
+    unsigned hash;
+} intern_entry;
+
+static intern_hdr* intern_header(char* name) {
+    return (intern_hdr*)(name - offsetof(intern_hdr, name));
+}
+
+static intern_entry* names = NULL;
+static int names_count = 0;
+static int names_cap = 0;
+static pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void intern_grow(void) {
+    int ncap = names_cap ? names_cap * 2 : 256;
+    intern_entry* n = calloc(ncap, sizeof(intern_entry));
+    for (int i = 0; i < names_cap; i++) {
+        if (names[i].name == NULL) { continue; }
+        int j = names[i].hash & (ncap - 1);
+        while (n[j].name) { j = (j + 1) & (ncap - 1); }
+        n[j] = names[i];
+    }
+    free(names);
+    names = n;
+    names_cap = ncap;
+}
+
+char* intern(const char* s, unsigned* hash) {
+    return internn(s, strlen(s), hash);
+}
+
+char* internn(const char* s, size_t len, unsigned* hash) {
+    unsigned h = hash_str(s, len);
+    pthread_mutex_lock(&names_mutex);
+    if ((names_count + 1) * 2 > names_cap) { intern_grow(); }
+    int i = h & (names_cap - 1);
+    while (names[i].name) {
+        if (names[i].hash == h && strncmp(names[i].name, s, len) == 0
+                && names[i].name[len] == '\0') { break; }
+        i = (i + 1) & (names_cap - 1);
+    }
+    if (names[i].name == NULL) {
+        intern_hdr* x = malloc(sizeof(intern_hdr) + len + 1);
+        x->hash = h;
+        x->local = 0;
+        memcpy(x->name, s, len);
+        x->name[len] = '\0';
+        names[i].name = x->name;
+        names[i].hash = h;
+        names_count++;
+    }
+    char* name = names[i].name;
+    pthread_mutex_unlock(&names_mutex);
+    if (hash) { *hash = h; }
+    return name;
+}
+
+void intern_mark_local(char* name) {
+    intern_hdr* x = intern_header(name);
+    if (!__atomic_load_n(&x->local, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&x->local, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int intern_is_local(char* name) {
+    return __atomic_load_n(&intern_header(name)->local, __ATOMIC_RELAXED);
+}
+
+/* Symbol tables. Open addressing with linear probing, kept at most
+   half full. Bindings are never removed, only replaced */
+
+void symtab_init(symtab* t) {
+    t->count = 0;
+    t->cap = 0;
+    t->entries = NULL;
+}
+
+void symtab_free(symtab* t) {
+    free(t->entries);
+    symtab_init(t);
+}
+
+/* a shallow copy, the caller takes any references it needs */
+void symtab_copy(symtab* dst, symtab* src) {
+    dst->count = src->count;
+    dst->cap = src->cap;
+    dst->entries = NULL;
+    if (src->cap) {
+        dst->entries = malloc(sizeof(symtab_entry) * src->cap);
+        memcpy(dst->entries, src->entries, sizeof(symtab_entry) * src->cap);
+    }
+}
+
+struct lval* symtab_get(symtab* t, char* key, unsigned hash) {
+    if (t->count == 0) { return NULL; }
+    int i = hash & (t->cap - 1);
+    while (t->entries[i].key) {
+        if (t->entries[i].key == key) { return t->entries[i].val; }
+        i = (i + 1) & (t->cap - 1);
+    }
+    return NULL;
+}
+
+static symtab_entry* symtab_slot(symtab_entry* entries, int cap, char* key, unsigned hash) {
+    int i = hash & (cap - 1);
+    while (entries[i].key && entries[i].key != key) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &entries[i];
+}
+
+static void symtab_grow(symtab* t) {
+    int ncap = t->cap ? t->cap * 2 : 8;
+    symtab_entry* n = calloc(ncap, sizeof(symtab_entry));
+    for (int i = 0; i < t->cap; i++) {
+        symtab_entry* x = &t->entries[i];
+        if (x->key) { *symtab_slot(n, ncap, x->key, x->hash) = *x; }
+    }
+    free(t->entries);
+    t->entries = n;
+    t->cap = ncap;
+}
+
+struct lval* symtab_put(symtab* t, char* key, unsigned hash, struct lval* v) {
+    if ((t->count + 1) * 2 > t->cap) { symtab_grow(t); }
+    symtab_entry* x = symtab_slot(t->entries, t->cap, key, hash);
+    if (x->key) {
+        struct lval* old = x->val;
+        x->val = v;
+        return old;
+    }
+    x->key = key;
+    x->hash = hash;
+    x->val = v;
+    t->count++;
+    return NULL;
+}
+
+void symtab_traverse(symtab* t, int (*fn)(char*, struct lval*, void*), void* arg) {
+    for (int i = 0; i < t->cap; i++) {
+        symtab_entry* x = &t->entries[i];
+        if (x->key && !fn(x->key, x->val, arg)) { return; }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef LISPY_SYMTAB_H
+#define LISPY_SYMTAB_H
+
+#include <stddef.h>
+
+struct lval;
+
+/* Symbol names are interned: every occurrence of a name is the same
+   pointer, hashed once when it is first seen */
+char* intern(const char* s, unsigned* hash);
+/* the same for the len bytes at s, which need not end in a NUL */
+char* internn(const char* s, size_t len, unsigned* hash);
+/* whether an interned name has ever been bound outside the global env.
+   a name that never has can skip straight to the global lookup */
+void intern_mark_local(char* name);
+int  intern_is_local(char* name);
+
+/* a table of bindings keyed by interned names. keys compare by
+   pointer and carry their hash, so a lookup never touches the string */
+typedef struct symtab_entry {
+    char* key;
+    unsigned hash;
+    struct lval* val;
+} symtab_entry;
+
+typedef struct symtab {
+    int count;
+    int cap;
+    symtab_entry* entries;
+} symtab;
+
+void symtab_init(symtab* t);
+void symtab_free(symtab* t);
+void symtab_copy(symtab* dst, symtab* src);
+struct lval* symtab_get(symtab* t, char* key, unsigned hash);
+/* returns the value replaced, or NULL if the key is new */
+struct lval* symtab_put(symtab* t, char* key, unsigned hash, struct lval* v);
+/* calls fn for each binding until it returns 0 */
+void symtab_traverse(symtab* t, int (*fn)(char*, struct lval*, void*), void* arg);
+
+#endif
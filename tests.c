@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "ptest.h"
 #include "lispy.h"
+#include "slab.h"
+#include "reader.h"
 
 /* Test helper to evaluate a lispy expression and return result */
 lval* eval_string(lenv* e, const char* input) {
@@ -22,7 +25,7 @@ void test_addition(void) {
 
     lval* result = eval_string(e, "(+ 1 2 3)");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 6);
+    PT_ASSERT(result->inum == 6);
     lval_del(result);
 
     lenv_del(e);
@@ -34,7 +37,7 @@ void test_subtraction(void) {
 
     lval* result = eval_string(e, "(- 10 3 2)");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 5);
+    PT_ASSERT(result->inum == 5);
     lval_del(result);
 
     lenv_del(e);
@@ -46,7 +49,7 @@ void test_multiplication(void) {
 
     lval* result = eval_string(e, "(* 2 3 4)");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 24);
+    PT_ASSERT(result->inum == 24);
     lval_del(result);
 
     lenv_del(e);
@@ -64,11 +67,70 @@ void test_division(void) {
     lenv_del(e);
 }
 
+void test_mixed_operators(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(+ 1 2.5 3)");
+    PT_ASSERT(result->type == LVAL_FLOAT);
+    PT_ASSERT(result->num == 6.5);
+    lval_del(result);
+
+    result = eval_string(e, "(- 4)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == -4);
+    lval_del(result);
+
+    result = eval_string(e, "(le 2 2)");
+    PT_ASSERT(result->type == LVAL_BOOL);
+    PT_ASSERT((int)result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(str \"a\" 1 \"bc\" true)");
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT_STR_EQ(result->str, "a1bctrue");
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_integer_precision(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* integers are exact beyond 2^24 */
+    lval* result = eval_string(e, "(+ 16777217 1)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 16777218);
+    lval_del(result);
+
+    result = eval_string(e, "(mod 100000000007 10)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 7);
+    lval_del(result);
+
+    /* the one remainder that would trap */
+    result = eval_string(e, "(mod -9223372036854775808 -1)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 0);
+    lval_del(result);
+
+    /* overflowing 64 bits promotes to float */
+    result = eval_string(e, "(* 9223372036854775807 2)");
+    PT_ASSERT(result->type == LVAL_FLOAT);
+    PT_ASSERT(result->num > 1.8e19);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
 void suite_arithmetic(void) {
     pt_add_test(test_addition, "Test Addition", "Arithmetic");
     pt_add_test(test_subtraction, "Test Subtraction", "Arithmetic");
     pt_add_test(test_multiplication, "Test Multiplication", "Arithmetic");
     pt_add_test(test_division, "Test Division", "Arithmetic");
+    pt_add_test(test_mixed_operators, "Test Mixed Operators", "Arithmetic");
+    pt_add_test(test_integer_precision, "Test Integer Precision", "Arithmetic");
 }
 
 /* Test suite for list operations */
@@ -120,11 +182,46 @@ void test_join(void) {
     lenv_del(e);
 }
 
+void test_large_list(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* build a long list by repeated join, then index from both ends */
+    lval_del(eval_string(e, "(def {build} (\\ {n l} {if (eq n 0) {l} {build (- n 1) (join l (list n))}}))"));
+    lval* result = eval_string(e, "(build 500 {})");
+    PT_ASSERT(result->type == LVAL_QEXPR);
+    PT_ASSERT(result->count == 500);
+    PT_ASSERT(((lval*)list_index(result->cell, 0))->inum == 500);
+    PT_ASSERT(((lval*)list_index(result->cell, 499))->inum == 1);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_list_eq(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* every element is compared, not just the first */
+    lval* result = eval_string(e, "(eq {1 2 3} {1 2 4})");
+    PT_ASSERT(result->type == LVAL_BOOL);
+    PT_ASSERT((int)result->num == 0);
+    lval_del(result);
+
+    result = eval_string(e, "(eq {1 {2 3}} {1 {2 3}})");
+    PT_ASSERT((int)result->num == 1);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
 void suite_lists(void) {
     pt_add_test(test_list, "Test List", "Lists");
     pt_add_test(test_head, "Test Head", "Lists");
     pt_add_test(test_tail, "Test Tail", "Lists");
     pt_add_test(test_join, "Test Join", "Lists");
+    pt_add_test(test_large_list, "Test Large List", "Lists");
+    pt_add_test(test_list_eq, "Test List Eq", "Lists");
 }
 
 /* Test suite for conditionals */
@@ -134,7 +231,7 @@ void test_if_true(void) {
 
     lval* result = eval_string(e, "(if true {1} {0})");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 1);
+    PT_ASSERT(result->inum == 1);
     lval_del(result);
 
     lenv_del(e);
@@ -146,7 +243,7 @@ void test_if_false(void) {
 
     lval* result = eval_string(e, "(if false {1} {0})");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 0);
+    PT_ASSERT(result->inum == 0);
     lval_del(result);
 
     lenv_del(e);
@@ -182,12 +279,20 @@ void test_int_cast(void) {
 
     lval* result = eval_string(e, "(int 3.7)");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 3);
+    PT_ASSERT(result->inum == 3);
     lval_del(result);
 
     result = eval_string(e, "(int \"42\")");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 42);
+    PT_ASSERT(result->inum == 42);
+    lval_del(result);
+
+    /* floats with no int64 to cast to */
+    result = eval_string(e, "(int (* 9223372036854775807 2))");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+    result = eval_string(e, "(int (- 0 (* 9223372036854775807 2)))");
+    PT_ASSERT(result->type == LVAL_ERR);
     lval_del(result);
 
     lenv_del(e);
@@ -252,12 +357,36 @@ void test_get_field(void) {
 
     lval* result = eval_string(e, "(get p {x})");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 10);
+    PT_ASSERT(result->inum == 10);
     lval_del(result);
 
     result = eval_string(e, "(get p {y})");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 20);
+    PT_ASSERT(result->inum == 20);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_set_field(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    eval_string(e, "(deftype {Point} {x y})");
+    eval_string(e, "(def {p} (new {Point} 10 20))");
+
+    lval* result = eval_string(e, "(get (set p {x} 5) {x})");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 5);
+    lval_del(result);
+
+    /* a field update missing its value is an error, not a new set */
+    result = eval_string(e, "(set p {x})");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+
+    result = eval_string(e, "(set 1 2 3)");
+    PT_ASSERT(result->type == LVAL_ERR);
     lval_del(result);
 
     lenv_del(e);
@@ -266,6 +395,7 @@ void test_get_field(void) {
 void suite_user_types(void) {
     pt_add_test(test_deftype, "Test Deftype", "User Types");
     pt_add_test(test_get_field, "Test Get Field", "User Types");
+    pt_add_test(test_set_field, "Test Set Field", "User Types");
 }
 
 /* Test suite for fractions */
@@ -302,12 +432,12 @@ void test_frac_numer_denom(void) {
 
     lval* result = eval_string(e, "(numer (frac 3 4))");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 3);
+    PT_ASSERT(result->inum == 3);
     lval_del(result);
 
     result = eval_string(e, "(denom (frac 3 4))");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 4);
+    PT_ASSERT(result->inum == 4);
     lval_del(result);
 
     lenv_del(e);
@@ -327,7 +457,7 @@ void test_debug_eval(void) {
     /* Debug should evaluate expression and return result */
     lval* result = eval_string(e, "(debug {(+ 1 2)})");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 3);
+    PT_ASSERT(result->inum == 3);
     lval_del(result);
 
     lenv_del(e);
@@ -340,7 +470,7 @@ void test_debug_nested(void) {
     /* Debug with nested expressions */
     lval* result = eval_string(e, "(debug {(* 2 (+ 3 4))})");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 14);
+    PT_ASSERT(result->inum == 14);
     lval_del(result);
 
     lenv_del(e);
@@ -359,7 +489,7 @@ void test_spawn_wait(void) {
     /* Spawn a thread and wait for result */
     lval* result = eval_string(e, "(wait (spawn {(+ 10 20)}))");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 30);
+    PT_ASSERT(result->inum == 30);
     lval_del(result);
 
     lenv_del(e);
@@ -375,12 +505,12 @@ void test_multiple_threads(void) {
 
     lval* r1 = eval_string(e, "(wait t1)");
     PT_ASSERT(r1->type == LVAL_LONG);
-    PT_ASSERT((long)r1->num == 12);
+    PT_ASSERT(r1->inum == 12);
     lval_del(r1);
 
     lval* r2 = eval_string(e, "(wait t2)");
     PT_ASSERT(r2->type == LVAL_LONG);
-    PT_ASSERT((long)r2->num == 11);
+    PT_ASSERT(r2->inum == 11);
     lval_del(r2);
 
     lenv_del(e);
@@ -394,8 +524,62 @@ void test_thread_with_env(void) {
     eval_string(e, "(def {x} 100)");
     lval* result = eval_string(e, "(wait (spawn {(+ x 1)}))");
     PT_ASSERT(result->type == LVAL_LONG);
-    PT_ASSERT((long)result->num == 101);
+    PT_ASSERT(result->inum == 101);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_thread_ids_reused(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* ids are handed out again once waited for, so there is no cap */
+    eval_string(e, "(def {loop} (\\ {n acc} {if (eq n 0) {acc} {loop (- n 1) (+ acc (wait (spawn {n})))}}))");
+    lval* result = eval_string(e, "(loop 500 0)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 125250);
+    lval_del(result);
+
+    lval_del(eval_string(e, "(def {t} (spawn {1}))"));
+    lval_del(eval_string(e, "(wait t)"));
+    result = eval_string(e, "(eq t (spawn {2}))");
+    PT_ASSERT(result->num == 1);
     lval_del(result);
+    lval_del(eval_string(e, "(wait t)"));
+
+    /* a task waiting on one it spawned doesn't hold up the pool */
+    result = eval_string(e, "(wait (spawn {(wait (spawn {(+ 40 2)}))}))");
+    PT_ASSERT(result->inum == 42);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_thread_env_isolated(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* tasks keep running while globals are defined around them, they
+       see the bindings as they were when spawned and keep their own defs */
+    lval_del(eval_string(e, "(def {x} 1)"));
+    lval_del(eval_string(e, "(def {spin} (\\ {n} {if (eq n 0) {x} {spin (- n 1)}}))"));
+    /* spawned from inside a function, so the globals are only reached
+       through the caller's frame */
+    lval_del(eval_string(e, "(def {go} (\\ {f} {spawn {f 2000}}))"));
+    lval_del(eval_string(e, "(def {a} (go spin))"));
+    lval_del(eval_string(e, "(def {b} (go (\\ {n} {do (def {x} 5) (spin n)})))"));
+    lval_del(eval_string(e, "(def {pm} (\\ {l} {pmap (\\ {n} {def {y} n}) l}))"));
+    for (int i = 0; i < 200; i++) {
+        char def[64];
+        snprintf(def, sizeof(def), "(def {g%d y} %d 2)", i, i);
+        lval_del(eval_string(e, def));
+    }
+    lval* result = eval_string(e, "(list (wait a) (wait b) x (len (pm {1 2 3 4})) y)");
+    lval* expected = eval_string(e, "{1 5 1 4 2}");
+    lval* same = lval_eq(result, expected);
+    PT_ASSERT(same->num == 1);
+    lval_del(same); lval_del(expected); lval_del(result);
 
     lenv_del(e);
 }
@@ -404,6 +588,1071 @@ void suite_threads(void) {
     pt_add_test(test_spawn_wait, "Test Spawn Wait", "Threads");
     pt_add_test(test_multiple_threads, "Test Multiple Threads", "Threads");
     pt_add_test(test_thread_with_env, "Test Thread With Env", "Threads");
+    pt_add_test(test_thread_ids_reused, "Test Thread Ids Reused", "Threads");
+    pt_add_test(test_thread_env_isolated, "Test Thread Env Isolated", "Threads");
+}
+
+/* Test suite for shared (copy-on-write) values */
+void test_shared_list_unchanged(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* tail and join must not modify the list bound to l */
+    lval_del(eval_string(e, "(def {l} {1 2 3})"));
+    lval_del(eval_string(e, "(tail l)"));
+    lval_del(eval_string(e, "(join l {4})"));
+
+    lval* result = eval_string(e, "l");
+    PT_ASSERT(result->type == LVAL_QEXPR);
+    PT_ASSERT(result->count == 3);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_shared_lookup(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* looking up a symbol twice yields the same shared value */
+    lval_del(eval_string(e, "(def {l} {1 2 3})"));
+    lval* a = eval_string(e, "l");
+    lval* b = eval_string(e, "l");
+    PT_ASSERT(a == b);
+    lval_del(a);
+    lval_del(b);
+
+    /* partial application must not consume the bound function */
+    lval_del(eval_string(e, "(def {add} (\\ {x y} {+ x y}))"));
+    lval_del(eval_string(e, "(def {inc} (add 1))"));
+    lval* r1 = eval_string(e, "(inc 1)");
+    lval* r2 = eval_string(e, "(inc 2)");
+    PT_ASSERT(r1->inum == 2);
+    PT_ASSERT(r2->inum == 3);
+    lval_del(r1);
+    lval_del(r2);
+
+    lenv_del(e);
+}
+
+void test_immortal_values(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* small integers and booleans are preallocated and shared */
+    PT_ASSERT(lval_long(7) == lval_long(7));
+    PT_ASSERT(lval_bool(1) == lval_bool(1));
+
+    /* so small arithmetic allocates nothing that outlives it */
+    int before = counter;
+    lval* result = eval_string(e, "(eq (+ 1 2) (* 3 1))");
+    PT_ASSERT(result->type == LVAL_BOOL && result->num == 1);
+    PT_ASSERT(counter == before);
+    lval_del(result);
+
+    /* unsharing one gives a private copy */
+    lval* x = lval_unshare(lval_long(7));
+    PT_ASSERT(x != lval_long(7));
+    PT_ASSERT(x->inum == 7);
+    lval_del(x);
+
+    lenv_del(e);
+}
+
+void test_shared_string_unchanged(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* appending to a bound string gives a new one, the binding keeps its own */
+    lval_del(eval_string(e, "(def {s} \"hello\")"));
+    lval* result = eval_string(e, "(str s \" world\")");
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT_STR_EQ(result->str, "hello world");
+    lval_del(result);
+
+    result = eval_string(e, "s");
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT_STR_EQ(result->str, "hello");
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_sharing(void) {
+    pt_add_test(test_shared_list_unchanged, "Test Shared List Unchanged", "Sharing");
+    pt_add_test(test_shared_lookup, "Test Shared Lookup", "Sharing");
+    pt_add_test(test_shared_string_unchanged, "Test Shared String Unchanged", "Sharing");
+    pt_add_test(test_immortal_values, "Test Immortal Values", "Sharing");
+}
+
+/* Test suite for the slab allocator */
+void test_slab_reuse(void) {
+    /* a freed object is handed straight back for the next allocation */
+    lval* a = lval_float(1.0);
+    lval_del(a);
+    lval* b = lval_float(2.0);
+#ifndef SLAB_DISABLE
+    PT_ASSERT(a == b);
+#endif
+    lval_del(b);
+
+    /* sizes past the largest class still work */
+    char* big = slab_alloc(SLAB_MAX_SIZE * 4);
+    memset(big, 0, SLAB_MAX_SIZE * 4);
+    slab_free(big, SLAB_MAX_SIZE * 4);
+}
+
+void test_slab_counter(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* every lval taken from the slab is given back */
+    int before = counter;
+    lval_del(eval_string(e, "(join {1 2 3 4 5} {6 7 8 9} (list 10 11 12))"));
+    PT_ASSERT(counter == before);
+
+    lenv_del(e);
+}
+
+static void note_walked(void* p, void* arg) {
+    void** seen = arg;
+    for (int i = 0; i < 4; i++) {
+        if (seen[i] == p) { seen[i] = NULL; }
+    }
+}
+
+void test_slab_carving(void) {
+#ifndef SLAB_DISABLE
+    /* use up every free object, and the current chunk if it is nearly
+       done, so the next few have to be carved from a chunk */
+    int cap = 1024, n = 0;
+    void** held = malloc(sizeof(void*) * cap);
+    int spare, used, count;
+    for (;;) {
+        slab_pool_usage(&spare, &used, &count);
+        if (spare == 0 && count - used >= 4) { break; }
+        if (n == cap) { held = realloc(held, sizeof(void*) * (cap *= 2)); }
+        held[n++] = slab_pool_alloc(sizeof(lval));
+    }
+
+    /* carved objects come one after another */
+    size_t stride = (sizeof(lval) + 15) / 16 * 16;
+    char* x = slab_pool_alloc(sizeof(lval));
+    char* y = slab_pool_alloc(sizeof(lval));
+    char* z = slab_pool_alloc(sizeof(lval));
+    PT_ASSERT(y == x + stride);
+    PT_ASSERT(z == y + stride);
+    int now_used;
+    slab_pool_usage(&spare, &now_used, &count);
+    PT_ASSERT(now_used == used + 3);
+
+    /* the walk stops at what has been carved, even if the next object
+       along looks live */
+    char* next = z + stride;
+    *(unsigned*)next = 0;
+    void* seen[4] = { x, y, z, next };
+    slab_pool_walk(sizeof(lval), note_walked, seen);
+    PT_ASSERT(seen[0] == NULL && seen[1] == NULL && seen[2] == NULL);
+    PT_ASSERT(seen[3] == next);
+
+    slab_pool_free(x, sizeof(lval));
+    slab_pool_free(y, sizeof(lval));
+    slab_pool_free(z, sizeof(lval));
+    for (int i = 0; i < n; i++) { slab_pool_free(held[i], sizeof(lval)); }
+    free(held);
+#endif
+}
+
+void test_lval_size(void) {
+    /* the payload is a union, so a value is a small header plus its largest member */
+    PT_ASSERT(sizeof(lval) <= 64);
+
+    lval* f = lval_float(1.5);
+    lval* c = lval_copy(f);
+    PT_ASSERT(c->type == LVAL_FLOAT && c->num == 1.5);
+    lval_del(f);
+    lval_del(c);
+}
+
+void suite_slab(void) {
+    pt_add_test(test_slab_reuse, "Test Slab Reuse", "Slab");
+    pt_add_test(test_slab_counter, "Test Slab Counter", "Slab");
+    pt_add_test(test_slab_carving, "Test Slab Carving", "Slab");
+    pt_add_test(test_lval_size, "Test Lval Size", "Slab");
+}
+
+/* Test suite for symbol interning */
+void test_symbols_interned(void) {
+    lval* a = lval_sym("foo");
+    lval* b = lval_sym("foo");
+    lval* c = lval_sym("bar");
+    PT_ASSERT(a->str == b->str);
+    PT_ASSERT(a->hash == b->hash);
+    PT_ASSERT(a->str != c->str);
+    lval_del(a);
+    lval_del(b);
+    lval_del(c);
+}
+
+void test_symbol_lookup(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval_del(eval_string(e, "(def {x} 5)"));
+    lval* result = eval_string(e, "((\\ {y} {+ x y}) 2)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 7);
+    lval_del(result);
+
+    /* a symbol turned into a string gets its own copy of the name */
+    result = builtin_str_op(e, lval_add(lval_add(lval_sexpr(), lval_sym("ab")), lval_str("c")));
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT(strcmp(result->str, "abc") == 0);
+    lval_del(result);
+
+    result = eval_string(e, "(eq {x} {x})");
+    PT_ASSERT(result->type == LVAL_BOOL && result->num == 1);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_symbols(void) {
+    pt_add_test(test_symbols_interned, "Test Symbols Interned", "Symbols");
+    pt_add_test(test_symbol_lookup, "Test Symbol Lookup", "Symbols");
+}
+
+/* Test suite for call frames */
+void test_frame_slots(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* formals live in slots, rebinding one with = updates the slot */
+    lval_del(eval_string(e, "(def {f} (\\ {x y} {do (= {x} (* x 10)) (+ x y)}))"));
+    lval* result = eval_string(e, "(f 2 3)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 23);
+    lval_del(result);
+
+    /* partially applied functions keep the slots already bound */
+    lval_del(eval_string(e, "(def {g} (f 4))"));
+    result = eval_string(e, "(g 1)");
+    PT_ASSERT(result->inum == 41);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_frame_dynamic_scope(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a callee still sees its caller's formals, scope is dynamic */
+    lval_del(eval_string(e, "(def {inner} (\\ {} {+ depth 1}))"));
+    lval_del(eval_string(e, "(def {outer} (\\ {depth} {inner}))"));
+    lval* result = eval_string(e, "(outer 41)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 42);
+    lval_del(result);
+
+    /* variadic formals get a slot too */
+    lval_del(eval_string(e, "(def {sum} (\\ {& xs} {eval (join {+} xs)}))"));
+    result = eval_string(e, "(sum 1 2 3)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 6);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_closure_env_shared(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* copying a function shares its env and formals */
+    lval_del(eval_string(e, "(def {add} (\\ {x y} {+ x y}))"));
+    lval* f = eval_string(e, "add");
+    lval* c = lval_copy(f);
+    PT_ASSERT(c->env == f->env);
+    PT_ASSERT(c->formals == f->formals);
+    lval_del(c);
+
+    /* calling it binds into a private env, the stored one stays empty */
+    lval* result = eval_string(e, "(add 1 2)");
+    PT_ASSERT(result->inum == 3);
+    lval_del(result);
+    PT_ASSERT(f->env->count == 0);
+    PT_ASSERT(f->formals->count == 2);
+    lval_del(f);
+
+    lenv_del(e);
+}
+
+void suite_frames(void) {
+    pt_add_test(test_frame_slots, "Test Frame Slots", "Frames");
+    pt_add_test(test_frame_dynamic_scope, "Test Frame Dynamic Scope", "Frames");
+    pt_add_test(test_closure_env_shared, "Test Closure Env Shared", "Frames");
+}
+
+/* Test suite for the collector */
+void test_gc_cycle(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a function bound in its own env keeps itself alive */
+    lval* f = eval_string(e, "(\\ {x} {x})");
+    lval* k = lval_sym("self");
+    lenv_put(f->env, k, f);
+    lval_del(k);
+    lval_del(f);
+
+#ifndef SLAB_DISABLE
+    int before = counter;
+    PT_ASSERT(lval_gc(e) >= 1);
+    PT_ASSERT(counter < before);
+#endif
+
+    /* everything reachable from e survives */
+    lval_del(eval_string(e, "(def {l} {1 2 3})"));
+    lval_gc(e);
+    lval* result = eval_string(e, "(eval (join {+} l))");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 6);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_gc_error_leak(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a bad condition used to leave both branches allocated */
+    lval_gc(e);
+    int before = counter;
+    lval* result = eval_string(e, "(if 1 {\"a\"} {\"b\"})");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+    lval_gc(e);
+    /* without the slab there is no pool to sweep */
+#ifndef SLAB_DISABLE
+    PT_ASSERT(counter == before);
+#else
+    (void)before;
+#endif
+
+    /* (gc) itself only asks for a collection */
+    result = eval_string(e, "(gc)");
+    PT_ASSERT(gc_requested == 1);
+    gc_requested = 0;
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_gc(void) {
+    pt_add_test(test_gc_cycle, "Test GC Cycle", "GC");
+    pt_add_test(test_gc_error_leak, "Test GC Error Leak", "GC");
+}
+
+/* Test suite for tail calls */
+void test_tail_recursion(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* deep enough to overflow the C stack without tail calls */
+    lval_del(eval_string(e, "(def {loop} (\\ {n acc} {if (eq n 0) {acc} {loop (- n 1) (+ acc 1)}}))"));
+    lval* result = eval_string(e, "(loop 100000 0)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 100000);
+    lval_del(result);
+
+    /* the last form of do is in tail position too */
+    lval_del(eval_string(e, "(def {cd} (\\ {n} {do (= {m} n) (if (eq n 0) {m} {cd (- n 1)})}))"));
+    result = eval_string(e, "(cd 100000)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 0);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_tail_call_scope(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a tail callee still sees its caller's bindings */
+    lval_del(eval_string(e, "(def {inner} (\\ {l} {+ off (eval (head l))}))"));
+    lval_del(eval_string(e, "(def {outer} (\\ {off l} {inner l}))"));
+    lval* result = eval_string(e, "(outer 10 {5})");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 15);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_tail_calls(void) {
+    pt_add_test(test_tail_recursion, "Test Tail Recursion", "Tail Calls");
+    pt_add_test(test_tail_call_scope, "Test Tail Call Scope", "Tail Calls");
+}
+
+/* Test suite for compiled lambda bodies */
+void test_vm_special_forms(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* do stops at the first error */
+    lval_del(eval_string(e, "(def {f} (\\ {x} {do (error \"boom\") (+ x 1)}))"));
+    lval* result = eval_string(e, "(f 1)");
+    PT_ASSERT(result->type == LVAL_ERR);
+    PT_ASSERT_STR_EQ(result->str, "boom");
+    lval_del(result);
+
+    /* if takes a Q-expression condition, and rejects non-booleans */
+    lval_del(eval_string(e, "(def {g} (\\ {x} {if {eq x 1} {\"one\"} {\"other\"}}))"));
+    result = eval_string(e, "(g 2)");
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT_STR_EQ(result->str, "other");
+    lval_del(result);
+
+    lval_del(eval_string(e, "(def {h} (\\ {x} {if x {1} {2}}))"));
+    result = eval_string(e, "(h 3)");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_vm_rebound_forms(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a formal named do is not the do builtin */
+    lval_del(eval_string(e, "(def {f} (\\ {do x} {do x}))"));
+    lval* result = eval_string(e, "(f (\\ {y} {+ y 1}) 5)");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 6);
+    lval_del(result);
+
+    /* debug tree walks lambda bodies and agrees with the VM */
+    lval_del(eval_string(e, "(def {sq} (\\ {x} {* x x}))"));
+    result = eval_string(e, "(debug {sq 7})");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 49);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_vm(void) {
+    pt_add_test(test_vm_special_forms, "Test VM Special Forms", "VM");
+    pt_add_test(test_vm_rebound_forms, "Test VM Rebound Forms", "VM");
+}
+
+/* Test suite for higher order list functions */
+void test_map_filter(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(map (\\ {x} {* x x}) {1 2 3})");
+    PT_ASSERT(result->type == LVAL_QEXPR);
+    PT_ASSERT(result->count == 3);
+    PT_ASSERT(((lval*)list_index(result->cell, 2))->inum == 9);
+    lval_del(result);
+
+    result = eval_string(e, "(filter (\\ {x} {gt x 1}) {1 2 3})");
+    PT_ASSERT(result->count == 2);
+    PT_ASSERT(((lval*)list_index(result->cell, 0))->inum == 2);
+    lval_del(result);
+
+    /* an error stops the walk */
+    result = eval_string(e, "(map (\\ {x} {/ 1 x}) {1 0 2})");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_fold(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(foldl + 0 (range 101))");
+    PT_ASSERT(result->inum == 5050);
+    lval_del(result);
+
+    result = eval_string(e, "(foldl - 0 {1 2 3})");
+    PT_ASSERT(result->inum == -6);
+    lval_del(result);
+
+    result = eval_string(e, "(foldr - 0 {1 2 3})");
+    PT_ASSERT(result->inum == 2);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_list_helpers(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(eq (range 1 10 3) {1 4 7})");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(eq (reverse {1 2 3}) {3 2 1})");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(nth 1 {a b c})");
+    PT_ASSERT(result->type == LVAL_SYM);
+    PT_ASSERT(strcmp(result->str, "b") == 0);
+    lval_del(result);
+
+    result = eval_string(e, "(len (range 7))");
+    PT_ASSERT(result->inum == 7);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_pmap(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(eq (pmap (\\ {x} {* x x}) (range 100)) (map (\\ {x} {* x x}) (range 100)))");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    /* the first error in list order is the one returned */
+    result = eval_string(e, "(pmap (\\ {x} {if (eq x 40) {error \"forty\"} {/ 1 x}}) (range 1 100))");
+    PT_ASSERT(result->type == LVAL_ERR);
+    PT_ASSERT_STR_EQ(result->str, "forty");
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_higher_order(void) {
+    pt_add_test(test_map_filter, "Test Map Filter", "Higher Order");
+    pt_add_test(test_fold, "Test Fold", "Higher Order");
+    pt_add_test(test_list_helpers, "Test List Helpers", "Higher Order");
+    pt_add_test(test_pmap, "Test Pmap", "Higher Order");
+}
+
+/* Test suite for dictionaries */
+void test_dict_get_set(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(def {d} (dict {a 1 b 2 \"s\" 3}))");
+    lval_del(result);
+
+    result = eval_string(e, "(dict-get d {b})");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 2);
+    lval_del(result);
+
+    result = eval_string(e, "(dict-get d \"s\")");
+    PT_ASSERT(result->inum == 3);
+    lval_del(result);
+
+    result = eval_string(e, "(dict-get (dict-set d {c} 4) {c})");
+    PT_ASSERT(result->inum == 4);
+    lval_del(result);
+
+    result = eval_string(e, "(dict-get d {c})");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_dict_versions(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* build a dict bigger than one node, then change it */
+    lval* result = eval_string(e,
+        "(def {fill} (\\ {n d} {if (eq n 0) {d} {fill (- n 1) (dict-set d n (* n n))}}))");
+    lval_del(result);
+    result = eval_string(e, "(def {d} (fill 500 (dict)))");
+    lval_del(result);
+    result = eval_string(e, "(def {d2} (dict-del (dict-set d 7 0) 8))");
+    lval_del(result);
+
+    /* the old version is untouched */
+    result = eval_string(e, "(dict-get d 7)");
+    PT_ASSERT(result->inum == 49);
+    lval_del(result);
+    result = eval_string(e, "(dict-has d 8)");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(dict-get d2 7)");
+    PT_ASSERT(result->inum == 0);
+    lval_del(result);
+    result = eval_string(e, "(dict-has d2 8)");
+    PT_ASSERT(result->num == 0);
+    lval_del(result);
+
+    result = eval_string(e, "(dict-keys d2)");
+    PT_ASSERT(result->count == 499);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_dict_eq(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(eq (dict {a 1 b 2}) (dict-set (dict {b 2}) {a} 1))");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(eq (dict {a 1}) (dict {a 2}))");
+    PT_ASSERT(result->num == 0);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_dict_frac_keys(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* fractions near the ends of a long hash without overflowing */
+    lval_del(eval_string(e, "(def {d} (dict-set (dict) (frac 9223372036854775807 2) 1))"));
+    lval* result = eval_string(e, "(dict-get d (frac 9223372036854775807 2))");
+    PT_ASSERT(result->type == LVAL_LONG);
+    PT_ASSERT(result->inum == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(set-contains (set-of (frac -9223372036854775807 3)) (frac -9223372036854775807 3))");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_dicts(void) {
+    pt_add_test(test_dict_get_set, "Test Dict Get Set", "Dicts");
+    pt_add_test(test_dict_versions, "Test Dict Versions", "Dicts");
+    pt_add_test(test_dict_eq, "Test Dict Eq", "Dicts");
+    pt_add_test(test_dict_frac_keys, "Test Dict Frac Keys", "Dicts");
+}
+
+/* Test suite for vectors */
+void test_vec_get_set(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(def {v} (vec 1 2 3))");
+    lval_del(result);
+
+    result = eval_string(e, "(vec-get (vec-set v 1 7) 1)");
+    PT_ASSERT(result->inum == 7);
+    lval_del(result);
+
+    /* the old version is untouched */
+    result = eval_string(e, "(vec-get v 1)");
+    PT_ASSERT(result->inum == 2);
+    lval_del(result);
+
+    result = eval_string(e, "(vec-get v 3)");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_vec_push(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* deep enough for three levels of nodes */
+    lval* result = eval_string(e,
+        "(def {fill} (\\ {n v} {if (eq n 0) {v} {fill (- n 1) (vec-push v n)}}))");
+    lval_del(result);
+    result = eval_string(e, "(def {v} (fill 2000 (vec)))");
+    lval_del(result);
+
+    result = eval_string(e, "(vec-len v)");
+    PT_ASSERT(result->inum == 2000);
+    lval_del(result);
+
+    result = eval_string(e, "(vec-get v 1999)");
+    PT_ASSERT(result->inum == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(vec-get (vec-set v 1500 0) 1500)");
+    PT_ASSERT(result->inum == 0);
+    lval_del(result);
+
+    result = eval_string(e, "(eq (vec-list (vec 1 2)) {1 2})");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_vectors(void) {
+    pt_add_test(test_vec_get_set, "Test Vec Get Set", "Vectors");
+    pt_add_test(test_vec_push, "Test Vec Push", "Vectors");
+}
+
+/* Test suite for sets */
+void test_set_members(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(def {s} (set-of 1 2 \"a\" {x y}))");
+    lval_del(result);
+
+    result = eval_string(e, "(set-contains s {x y})");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(set-contains (set-add s 4) 4)");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    /* the old version is untouched */
+    result = eval_string(e, "(set-contains s 4)");
+    PT_ASSERT(result->num == 0);
+    lval_del(result);
+
+    result = eval_string(e, "(set-contains (set-del s 1) 1)");
+    PT_ASSERT(result->num == 0);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_set_bulk(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = eval_string(e, "(eq (union (set-of 1 2) (set-of 2 3)) (set-of 1 2 3))");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(eq (intersection (set-of 1 2 3) (set-of 2 3 4)) (set-of 2 3))");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    result = eval_string(e, "(eq (difference (set-of 1 2 3) (set-of 2 5)) (set-of 1 3))");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+void suite_sets(void) {
+    pt_add_test(test_set_members, "Test Set Members", "Sets");
+    pt_add_test(test_set_bulk, "Test Set Bulk", "Sets");
+}
+
+/* Test suite for the reader */
+void test_reader_matches_mpc(void) {
+    const char* inputs[] = {
+        "(+ 1 2) {a b}",
+        "(def {x} -3.25) ; trailing comment",
+        "\"a\\n\\\"q\\\"\\x\" 12ab trueish falsey",
+        "{1 {2 {3 -}}}\n\t- -1 x-1 \\ && =<>",
+    };
+    for (int i = 0; i < 4; i++) {
+        mpc_result_t r;
+        PT_ASSERT(mpc_parse("<test>", inputs[i], Lispy, &r));
+        lval* want = lval_read(r.output);
+        mpc_ast_delete(r.output);
+
+        lval* err = NULL;
+        lval* got = read_forms("<test>", inputs[i], strlen(inputs[i]), &err);
+        PT_ASSERT(got != NULL);
+        lval* same = lval_eq(got, want);
+        PT_ASSERT(same->num == 1);
+        lval_del(same);
+        lval_del(got);
+        lval_del(want);
+    }
+}
+
+void test_reader_errors(void) {
+    lval* err = NULL;
+    PT_ASSERT(read_forms("<test>", "(+ 1\n  {2 3)", 12, &err) == NULL);
+    PT_ASSERT_STR_EQ(err->str, "<test>:2:7: error: unexpected ')'");
+    lval_del(err);
+
+    err = NULL;
+    PT_ASSERT(read_forms("<test>", "(print \"abc", 11, &err) == NULL);
+    PT_ASSERT_STR_EQ(err->str, "<test>:1:8: error: unterminated string");
+    lval_del(err);
+
+    /* forms come one at a time, and the source needs no NUL */
+    reader r;
+    reader_init(&r, "<test>", "(a) b (c) garbage", 9);
+    lval* x = reader_next(&r);
+    PT_ASSERT(x->type == LVAL_SEXPR && x->count == 1);
+    lval_del(x);
+    x = reader_next(&r);
+    PT_ASSERT(x->type == LVAL_SYM);
+    lval_del(x);
+    x = reader_next(&r);
+    PT_ASSERT(x->type == LVAL_SEXPR);
+    lval_del(x);
+    PT_ASSERT(reader_next(&r) == NULL);
+    PT_ASSERT(r.err == NULL);
+}
+
+void test_load_streams(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a form longer than load reads at a time, and an error after it */
+    const char* path = "test_load.lspy";
+    FILE* f = fopen(path, "w");
+    fputs("(def {a} 1) (def {s} \"", f);
+    for (int i = 0; i < 100000; i++) { fputc('x', f); }
+    fputs("\")\n(def {b} (+ a 1))\n(def {c} 3))", f);
+    fclose(f);
+
+    lval* result = eval_string(e, "(load \"test_load.lspy\")");
+    PT_ASSERT(result->type == LVAL_ERR);
+    PT_ASSERT(strstr(result->str, "test_load.lspy:3:12: error: unexpected ')'") != NULL);
+    lval_del(result);
+    remove(path);
+
+    /* everything before the error was evaluated */
+    result = eval_string(e, "s");
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT(strlen(result->str) == 100000);
+    lval_del(result);
+    result = eval_string(e, "c");
+    PT_ASSERT(result->inum == 3);
+    lval_del(result);
+
+    lenv_del(e);
+}
+
+/* a comment running up to just before offset at of f */
+static void pad_to(FILE* f, long at) {
+    long n = at - ftell(f);
+    fputc(';', f);
+    for (long i = 2; i < n; i++) { fputc('x', f); }
+    fputc('\n', f);
+}
+
+void test_load_mapped(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* a file on disk is mapped and read in place. forms straddle page
+       boundaries, one before and one past where load lets go of the
+       pages it has read, a little over a megabyte in */
+    long page = sysconf(_SC_PAGESIZE);
+    long far = ((1 << 20) / page + 8) * page;
+    const char* path = "test_mapped.lspy";
+    FILE* f = fopen(path, "w");
+    fputs("(def {n} 0)\n", f);
+    for (long at = page; at < far; at += page) {
+        pad_to(f, at - 4);
+        fputs("(def {n} (+ n 1))\n", f);
+    }
+    pad_to(f, far + page - 10);
+    fputs("(def {across_the_page_edge} \"spans\")\n", f);
+    pad_to(f, far + 2 * page - 3);
+    fputs("(def {last} (+ n 1000))", f);
+    fclose(f);
+
+    lval* result = eval_string(e, "(load \"test_mapped.lspy\")");
+    PT_ASSERT(result->type != LVAL_ERR);
+    lval_del(result);
+    remove(path);
+
+    result = eval_string(e, "(list n across_the_page_edge last)");
+    char expected_src[64];
+    snprintf(expected_src, sizeof(expected_src), "{%ld \"spans\" %ld}", far / page - 1, far / page - 1 + 1000);
+    lval* expected = eval_string(e, expected_src);
+    lval* same = lval_eq(result, expected);
+    PT_ASSERT(same->num == 1);
+    lval_del(same); lval_del(expected); lval_del(result);
+
+    lenv_del(e);
+}
+
+void test_compile_image(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    const char* path = "test_image.lspy";
+    FILE* f = fopen(path, "w");
+    fputs("(def {xs} {1 -2 3.5 \"s\\n\" true xs xs}) (def {n} (+ 1 99999999999))", f);
+    fclose(f);
+
+    lval* result = eval_string(e, "(compile \"test_image.lspy\")");
+    PT_ASSERT(result->type == LVAL_STR);
+    PT_ASSERT_STR_EQ(result->str, "test_image.lspyc");
+    lval_del(result);
+
+    /* loading the image gives back what reading the source would */
+    lval_del(eval_string(e, "(load \"test_image.lspy\")"));
+    result = eval_string(e, "(eq xs {1 -2 3.5 \"s\\n\" true xs xs})");
+    PT_ASSERT(result->num == 1);
+    lval_del(result);
+    result = eval_string(e, "n");
+    PT_ASSERT(result->inum == 100000000000);
+    lval_del(result);
+
+    /* a changed source is read again, not the stale image */
+    f = fopen(path, "w");
+    fputs("(def {n} 7)", f);
+    fclose(f);
+    lval_del(eval_string(e, "(load \"test_image.lspy\")"));
+    result = eval_string(e, "n");
+    PT_ASSERT(result->inum == 7);
+    lval_del(result);
+
+    /* an image cut short is passed over for the source */
+    lval_del(eval_string(e, "(compile \"test_image.lspy\")"));
+    lval_del(eval_string(e, "(def {n} 0)"));
+    f = fopen("test_image.lspyc", "r+");
+    fseek(f, 0, SEEK_END);
+    PT_ASSERT(ftruncate(fileno(f), ftell(f) - 2) == 0);
+    fclose(f);
+    result = eval_string(e, "(load \"test_image.lspy\")");
+    PT_ASSERT(result->type != LVAL_ERR);
+    lval_del(result);
+    result = eval_string(e, "n");
+    PT_ASSERT(result->inum == 7);
+    lval_del(result);
+
+    remove(path);
+    remove("test_image.lspyc");
+    lenv_del(e);
+}
+
+void test_damaged_image(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    const char* path = "test_damaged.lspy";
+    FILE* f = fopen(path, "w");
+    fputs("(def {a} 1) (def {b} {2 3}) (def {c} \"four\")", f);
+    fclose(f);
+    lval_del(eval_string(e, "(compile \"test_damaged.lspy\")"));
+
+    /* one byte changed in the last form. none of the image is run,
+       the source is read instead */
+    f = fopen("test_damaged.lspyc", "r+");
+    fseek(f, -3, SEEK_END);
+    int c = fgetc(f);
+    fseek(f, -3, SEEK_END);
+    fputc(c ^ 0x40, f);
+    fclose(f);
+
+    lval* result = eval_string(e, "(load \"test_damaged.lspy\")");
+    PT_ASSERT(result->type != LVAL_ERR);
+    lval_del(result);
+    result = eval_string(e, "(list a b c)");
+    lval* expected = eval_string(e, "{1 {2 3} \"four\"}");
+    lval* same = lval_eq(result, expected);
+    PT_ASSERT(same->num == 1);
+    lval_del(same); lval_del(expected); lval_del(result);
+
+    remove(path);
+    remove("test_damaged.lspyc");
+    lenv_del(e);
+}
+
+void test_save_image(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+    lval_del(eval_string(e, "(def {add3} (\\ {a b c} {+ a b c}))"));
+    lval_del(eval_string(e, "(def {add1} (add3 1))"));
+    lval_del(eval_string(e, "(def {plus} +)"));
+    lval_del(eval_string(e, "(def {-} *)"));
+    lval_del(eval_string(e, "(def {fr} (frac 2 -6))"));
+    lval_del(eval_string(e, "(deftype {Point} {x y})"));
+    lval_del(eval_string(e, "(def {p} (new {Point} 3 4))"));
+    lval_del(eval_string(e, "(def {d} (dict {a 1 b {2 3}}))"));
+    lval_del(eval_string(e, "(def {s} (set-of 1 \"x\"))"));
+    lval_del(eval_string(e, "(def {v} (vec 1 (vec 2) 3.5))"));
+    lval* result = eval_string(e, "(save-image \"test_env.img\")");
+    PT_ASSERT(result->type == LVAL_SEXPR);
+    lval_del(result);
+    lenv_del(e);
+
+    /* a bare env given the image has what the saved one had */
+    e = lenv_new();
+    lenv_add_builtins(e);
+    result = lenv_restore(e, "test_env.img");
+    PT_ASSERT(result->type == LVAL_SEXPR);
+    lval_del(result);
+
+    result = eval_string(e, "(list (add1 2 3) (plus 2 3) (- 2 3) (numer fr) (denom fr))");
+    lval* expected = eval_string(e, "{6 5 6 -1 3}");
+    lval* same = lval_eq(result, expected);
+    PT_ASSERT(same->num == 1);
+    lval_del(same); lval_del(expected); lval_del(result);
+
+    result = eval_string(e, "(list (get p {y}) (dict-get d {b}) (set-contains s \"x\") (vec-get (vec-get v 1) 0) (vec-len v))");
+    expected = eval_string(e, "{4 {2 3} true 2 3}");
+    same = lval_eq(result, expected);
+    PT_ASSERT(same->num == 1);
+    lval_del(same); lval_del(expected); lval_del(result);
+
+    remove("test_env.img");
+    lenv_del(e);
+}
+
+void test_restore_errors(void) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    lval* result = lenv_restore(e, "test_env_missing.img");
+    PT_ASSERT(result->type == LVAL_ERR);
+    lval_del(result);
+
+    /* an image of forms is not an image of an env */
+    FILE* f = fopen("test_env.lspy", "w");
+    fputs("(def {n} 1)", f);
+    fclose(f);
+    lval_del(eval_string(e, "(compile \"test_env.lspy\")"));
+    result = lenv_restore(e, "test_env.lspyc");
+    PT_ASSERT(result->type == LVAL_ERR);
+    PT_ASSERT(strstr(result->str, "not an image of an env") != NULL);
+    lval_del(result);
+
+    /* nor is one cut short */
+    lval_del(eval_string(e, "(def {xs} {1 2 3})"));
+    lval_del(eval_string(e, "(save-image \"test_env.img\")"));
+    f = fopen("test_env.img", "r+");
+    fseek(f, 0, SEEK_END);
+    PT_ASSERT(ftruncate(fileno(f), ftell(f) - 1) == 0);
+    fclose(f);
+    result = lenv_restore(e, "test_env.img");
+    PT_ASSERT(result->type == LVAL_ERR);
+    PT_ASSERT(strstr(result->str, "damaged image") != NULL);
+    lval_del(result);
+
+    remove("test_env.lspy");
+    remove("test_env.lspyc");
+    remove("test_env.img");
+    lenv_del(e);
+}
+
+void suite_reader(void) {
+    pt_add_test(test_compile_image, "Test Compile Image", "Reader");
+    pt_add_test(test_damaged_image, "Test Damaged Image", "Reader");
+    pt_add_test(test_save_image, "Test Save Image", "Reader");
+    pt_add_test(test_restore_errors, "Test Restore Errors", "Reader");
+    pt_add_test(test_load_streams, "Test Load Streams", "Reader");
+    pt_add_test(test_load_mapped, "Test Load Mapped", "Reader");
+    pt_add_test(test_reader_matches_mpc, "Test Reader Matches Mpc", "Reader");
+    pt_add_test(test_reader_errors, "Test Reader Errors", "Reader");
 }
 
 /* Initialize parsers - must be called before tests */
@@ -448,6 +1697,18 @@ int main(int argc, char** argv) {
     pt_add_suite(suite_fractions);
     pt_add_suite(suite_debug);
     pt_add_suite(suite_threads);
+    pt_add_suite(suite_sharing);
+    pt_add_suite(suite_slab);
+    pt_add_suite(suite_symbols);
+    pt_add_suite(suite_frames);
+    pt_add_suite(suite_gc);
+    pt_add_suite(suite_tail_calls);
+    pt_add_suite(suite_vm);
+    pt_add_suite(suite_higher_order);
+    pt_add_suite(suite_dicts);
+    pt_add_suite(suite_vectors);
+    pt_add_suite(suite_sets);
+    pt_add_suite(suite_reader);
 
     int result = pt_run();
 
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lispy.h"
+#include "vec.h"
+
+/* Nodes. Whether a node is a leaf depends on how far above the
+   leaves it is, so that is passed down as shift */
+
+static vnode* vnode_alloc(void) {
+    vnode* n = calloc(1, sizeof(vnode));
+    n->refs = 1;
+    return n;
+}
+
+vnode* vnode_retain(vnode* n) {
+    __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+void vnode_release(vnode* n, int shift) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (shift == 0) {
+            lval_del(n->vals[i]);
+        } else {
+            vnode_release(n->kids[i], shift - VEC_BITS);
+        }
+    }
+    free(n);
+}
+
+/* a version of n that is safe to update, copied if it is shared */
+static vnode* vnode_own(vnode* n, int shift) {
+    if (__atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1) { return n; }
+    vnode* c = vnode_alloc();
+    c->count = n->count;
+    for (int i = 0; i < n->count; i++) {
+        if (shift == 0) {
+            c->vals[i] = lval_retain(n->vals[i]);
+        } else {
+            c->kids[i] = vnode_retain(n->kids[i]);
+        }
+    }
+    vnode_release(n, shift);
+    return c;
+}
+
+/* replace element i below n. consumes n and x */
+static vnode* vnode_set(vnode* n, int shift, int i, lval* x) {
+    n = vnode_own(n, shift);
+    int k = (i >> shift) & (VEC_WIDTH - 1);
+    if (shift == 0) {
+        lval_del(n->vals[k]);
+        n->vals[k] = x;
+    } else {
+        n->kids[k] = vnode_set(n->kids[k], shift - VEC_BITS, i, x);
+    }
+    return n;
+}
+
+/* add element i, the next one, below n, which may be NULL */
+static vnode* vnode_push(vnode* n, int shift, int i, lval* x) {
+    n = n ? vnode_own(n, shift) : vnode_alloc();
+    int k = (i >> shift) & (VEC_WIDTH - 1);
+    if (shift == 0) {
+        n->vals[k] = x;
+    } else {
+        n->kids[k] = vnode_push(k < n->count ? n->kids[k] : NULL, shift - VEC_BITS, i, x);
+    }
+    n->count = k + 1;
+    return n;
+}
+
+/* Vectors */
+
+void lvec_init(lvec* v) {
+    v->len = 0;
+    v->shift = 0;
+    v->root = NULL;
+}
+
+void lvec_free(lvec* v) {
+    if (v->root) { vnode_release(v->root, v->shift); }
+    lvec_init(v);
+}
+
+void lvec_copy(lvec* dst, lvec* src) {
+    *dst = *src;
+    if (dst->root) { vnode_retain(dst->root); }
+}
+
+lval* lvec_get(lvec* v, int i) {
+    vnode* n = v->root;
+    for (int shift = v->shift; shift > 0; shift -= VEC_BITS) {
+        n = n->kids[(i >> shift) & (VEC_WIDTH - 1)];
+    }
+    return n->vals[i & (VEC_WIDTH - 1)];
+}
+
+void lvec_set(lvec* v, int i, lval* x) {
+    v->root = vnode_set(v->root, v->shift, i, x);
+}
+
+void lvec_push(lvec* v, lval* x) {
+    if (v->root && v->len == VEC_WIDTH << v->shift) {
+        // the trie is full, grow a new root above it
+        vnode* r = vnode_alloc();
+        r->kids[0] = v->root;
+        r->count = 1;
+        v->root = r;
+        v->shift += VEC_BITS;
+    }
+    v->root = vnode_push(v->root, v->shift, v->len, x);
+    v->len++;
+}
@@ -0,0 +1,42 @@
+#ifndef LISPY_VEC_H
+#define LISPY_VEC_H
+
+struct lval;
+
+/* A persistent vector: a trie of 32 way nodes, leaves holding the
+   values in order. Nodes are reference counted and shared between
+   versions, so setting or pushing an element copies the path down to
+   it, a handful of nodes, and nothing else. Nodes that only one
+   version holds are updated in place */
+
+#define VEC_BITS  5
+#define VEC_WIDTH (1 << VEC_BITS)
+
+typedef struct vnode {
+    int refs;
+    int count;              /* slots in use, always the first ones */
+    union {
+        struct lval* vals[VEC_WIDTH];   /* in a leaf */
+        struct vnode* kids[VEC_WIDTH];  /* anywhere above */
+    };
+} vnode;
+
+typedef struct lvec {
+    int len;
+    int shift;              /* VEC_BITS times the height of root above the leaves */
+    vnode* root;
+} lvec;
+
+void  lvec_init(lvec* v);
+void  lvec_free(lvec* v);
+/* dst shares src's nodes until either is updated */
+void  lvec_copy(lvec* dst, lvec* src);
+struct lval* lvec_get(lvec* v, int i);
+/* both take x */
+void  lvec_set(lvec* v, int i, struct lval* x);
+void  lvec_push(lvec* v, struct lval* x);
+
+vnode* vnode_retain(vnode* n);
+void   vnode_release(vnode* n, int shift);
+
+#endif
@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lispy.h"
+#include "vm.h"
+
+/* Compiler. A lambda body is an S-expression, so it compiles to code
+   for each cell followed by an OP_APPLY of them all. if and do with
+   literal arguments are compiled inline, guarded at run time in case
+   the symbols have been rebound, and the generic call kept beside them */
+
+static lcode* lcode_new(void) {
+    lcode* c = malloc(sizeof(lcode));
+    c->refs = 1;
+    c->count = 0;
+    c->cap = 16;
+    c->ops = malloc(sizeof(int) * c->cap);
+    c->nconsts = 0;
+    c->constcap = 8;
+    c->consts = malloc(sizeof(lval*) * c->constcap);
+    c->depth = 0;
+    return c;
+}
+
+/* append an instruction, returning the index of its operand for patching */
+static int emit(lcode* c, int op, int arg) {
+    if (c->count + 2 > c->cap) {
+        c->cap *= 2;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
+    }
+    c->ops[c->count++] = op;
+    c->ops[c->count++] = arg;
+    return c->count - 1;
+}
+
+static void patch(lcode* c, int at) {
+    c->ops[at] = c->count;
+}
+
+/* add a constant, taking a reference to it */
+static int add_const(lcode* c, lval* v) {
+    if (c->nconsts == c->constcap) {
+        c->constcap *= 2;
+        c->consts = realloc(c->consts, sizeof(lval*) * c->constcap);
+    }
+    c->consts[c->nconsts] = lval_retain(v);
+    return c->nconsts++;
+}
+
+/* track how deep the stack gets */
+static void grow(lcode* c, int* sp, int n) {
+    *sp += n;
+    if (*sp > c->depth) { c->depth = *sp; }
+}
+
+static void compile_sexpr(lcode* c, lval* x, int tail, int* sp);
+
+/* the slot a formal is bound in, or -1 for any other symbol */
+static int resolve(lcode* c, lval* sym) {
+    for (int i = 0; i < c->frame->nslots; i++) {
+        if (c->frame->slots[i].key == sym->str) { return i; }
+    }
+    return -1;
+}
+
+/* load a symbol, straight from its slot if it is a formal */
+static void compile_load(lcode* c, lval* sym) {
+    int slot = resolve(c, sym);
+    if (slot >= 0) {
+        emit(c, OP_LOCAL, slot);
+    } else {
+        emit(c, OP_LOAD, add_const(c, sym));
+    }
+}
+
+/* compile code leaving the value of x on the stack */
+static void compile_expr(lcode* c, lval* x, int* sp) {
+    switch (x->type) {
+        case LVAL_SYM:   compile_load(c, x); grow(c, sp, 1); break;
+        case LVAL_SEXPR: compile_sexpr(c, x, 0, sp); break;
+        default:         emit(c, OP_CONST, add_const(c, x)); grow(c, sp, 1); break;
+    }
+}
+
+static int is_sym(lval* x, char* name) {
+    return x->type == LVAL_SYM && strcmp(x->str, name) == 0;
+}
+
+static lval* cell(lval* x, int i) {
+    return list_index(x->cell, i);
+}
+
+/* the generic call, with the head (and first skip cells) already pushed */
+static void compile_call(lcode* c, lval* x, int skip, int tail, int* sp) {
+    for (int i = skip; i < x->count; i++) {
+        compile_expr(c, cell(x, i), sp);
+    }
+    emit(c, tail ? OP_TAIL : OP_APPLY, x->count);
+    *sp -= x->count - 1;
+}
+
+/* (do a b ... z): a up to y for their effects, then z in place */
+static void compile_do(lcode* c, lval* x, int tail, int* sp) {
+    int base = *sp;
+    compile_load(c, cell(x, 0));
+    grow(c, sp, 1);
+    int generic = emit(c, OP_IFDO, 0);
+    *sp = base;
+
+    int ends[x->count];
+    int nends = 0;
+    for (int i = 1; i < x->count - 1; i++) {
+        compile_expr(c, cell(x, i), sp);
+        ends[nends++] = emit(c, OP_DROP, 0);
+        *sp = base;
+    }
+    if (tail && cell(x, x->count - 1)->type == LVAL_SEXPR) {
+        compile_sexpr(c, cell(x, x->count - 1), 1, sp);
+    } else {
+        compile_expr(c, cell(x, x->count - 1), sp);
+    }
+    ends[nends++] = emit(c, OP_JUMP, 0);
+
+    patch(c, generic);
+    *sp = base + 1;
+    compile_call(c, x, 1, tail, sp);
+
+    for (int i = 0; i < nends; i++) { patch(c, ends[i]); }
+    *sp = base + 1;
+}
+
+/* (if cond {a} {b}): the branches run inline as S-expressions */
+static void compile_if(lcode* c, lval* x, int tail, int* sp) {
+    int base = *sp;
+    compile_load(c, cell(x, 0));
+    grow(c, sp, 1);
+    int generic = emit(c, OP_IFIF, 0);
+    *sp = base;
+
+    compile_expr(c, cell(x, 1), sp);
+    int failed = emit(c, OP_COND, 0);
+    int orelse = emit(c, OP_JFALSE, 0);
+    *sp = base;
+    compile_sexpr(c, cell(x, 2), tail, sp);
+    int end = emit(c, OP_JUMP, 0);
+
+    patch(c, orelse);
+    *sp = base;
+    compile_sexpr(c, cell(x, 3), tail, sp);
+    int end2 = emit(c, OP_JUMP, 0);
+
+    patch(c, generic);
+    *sp = base + 1;
+    compile_call(c, x, 1, tail, sp);
+
+    patch(c, failed);
+    patch(c, end);
+    patch(c, end2);
+    *sp = base + 1;
+}
+
+/* compile the cells of x (an S- or Q-expression) as an S-expression */
+static void compile_sexpr(lcode* c, lval* x, int tail, int* sp) {
+    if (x->count >= 1 && is_sym(cell(x, 0), "help")) {
+        /* help takes its arguments unevaluated, leave it to the tree walker */
+        lval* y = lval_copy(x);
+        y->type = LVAL_SEXPR;
+        emit(c, OP_EVAL, add_const(c, y));
+        lval_del(y);
+        grow(c, sp, 1);
+        return;
+    }
+    if (x->count >= 2 && is_sym(cell(x, 0), "do")) {
+        compile_do(c, x, tail, sp);
+        return;
+    }
+    if (x->count == 4 && is_sym(cell(x, 0), "if") &&
+        cell(x, 2)->type == LVAL_QEXPR && cell(x, 3)->type == LVAL_QEXPR) {
+        compile_if(c, x, tail, sp);
+        return;
+    }
+    if (x->count == 0) {
+        emit(c, OP_APPLY, 0);
+        grow(c, sp, 1);
+        return;
+    }
+    compile_expr(c, cell(x, 0), sp);
+    compile_call(c, x, 1, tail, sp);
+}
+
+/* compile a lambda body, a Q-expression evaluated as an S-expression.
+   frame is the lambda's env, whose slots say where its formals live */
+lcode* lcode_compile(lval* body, lenv* frame) {
+    lcode* c = lcode_new();
+    c->frame = frame;
+    int sp = 0;
+    compile_sexpr(c, body, 1, &sp);
+    emit(c, OP_RET, 0);
+    c->frame = NULL;
+    return c;
+}
+
+lcode* lcode_retain(lcode* c) {
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+void lcode_release(lcode* c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+    for (int i = 0; i < c->nconsts; i++) { lval_del(c->consts[i]); }
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+/* VM */
+
+/* evaluate an S-expression whose cells are already values. returns the
+   result, or NULL with *callee set to a fully bound lambda to enter */
+static lval* vm_apply(lenv* e, lval* v, lval** callee) {
+    lval* r = lval_sexpr_value(v);
+    if (r) { return r; }
+
+    lval* f = lval_pop(v, 0);
+    if (f->builtin) {
+        r = f->builtin(e, v);
+        lval_del(f);
+        return r;
+    }
+
+    lval* g = lval_bind(e, f, v);
+    lval_del(f);
+    // an error, or a partially applied function
+    if (g->type == LVAL_ERR || g->formals->count > 0) { return g; }
+
+    g->env->par = e;
+    *callee = g;
+    return NULL;
+}
+
+/* collect the top n values of the stack into an S-expression */
+static lval* vm_collect(lval** stack, int* sp, int n) {
+    lval* v = lval_sexpr();
+    list_reserve(v->cell, n);
+    *sp -= n;
+    for (int i = 0; i < n; i++) {
+        lval_add(v, stack[*sp + i]);
+    }
+    return v;
+}
+
+/* run the body of f, a fully bound lambda whose env is ready. consumes f */
+lval* lcode_run(lval* f) {
+    lval* small[16];
+    lval** stack = small;
+    int cap = 16;
+    int sp = 0;
+
+    lcode* code = f->code;
+    lenv* e = f->env;
+    int pc = 0;
+    lval* result = NULL;
+
+    if (code->depth > cap) {
+        cap = code->depth;
+        stack = malloc(sizeof(lval*) * cap);
+    }
+
+    while (result == NULL) {
+        int op = code->ops[pc];
+        int arg = code->ops[pc + 1];
+        pc += 2;
+
+        switch (op) {
+            case OP_CONST:
+                stack[sp++] = lval_retain(code->consts[arg]);
+                break;
+            case OP_LOAD:
+                stack[sp++] = lenv_get(e, code->consts[arg]);
+                break;
+            case OP_LOCAL: {
+                symtab_entry* s = &e->slots[arg];
+                stack[sp++] = s->val ? lval_retain(s->val) : lenv_lookup(e, s->key, s->hash);
+            } break;
+            case OP_EVAL:
+                stack[sp++] = lval_eval(e, lval_retain(code->consts[arg]));
+                break;
+            case OP_IFDO:
+            case OP_IFIF: {
+                lval* x = stack[sp - 1];
+                lbuiltin want = op == OP_IFDO ? builtin_do : builtin_if;
+                if (x->type == LVAL_FUN && x->builtin == want) {
+                    lval_del(x);
+                    sp--;
+                } else {
+                    pc = arg;
+                }
+            } break;
+            case OP_DROP: {
+                lval* x = stack[sp - 1];
+                if (x->type == LVAL_ERR) {
+                    pc = arg;
+                } else {
+                    lval_del(x);
+                    sp--;
+                }
+            } break;
+            case OP_COND: {
+                lval* x = stack[sp - 1];
+                if (x->type == LVAL_QEXPR) {
+                    x = lval_unshare(x);
+                    x->type = LVAL_SEXPR;
+                    x = lval_eval(e, x);
+                }
+                if (x->type != LVAL_BOOL && x->type != LVAL_ERR) {
+                    lval* err = lval_err("First argument must be conditional. Got %s", ltype_name(x->type));
+                    lval_del(x);
+                    x = err;
+                }
+                stack[sp - 1] = x;
+                if (x->type == LVAL_ERR) { pc = arg; }
+            } break;
+            case OP_JFALSE: {
+                lval* x = stack[--sp];
+                if (x->num == 0) { pc = arg; }
+                lval_del(x);
+            } break;
+            case OP_JUMP:
+                pc = arg;
+                break;
+            case OP_APPLY:
+            case OP_TAIL: {
+                lval* g = NULL;
+                lval* r = vm_apply(e, vm_collect(stack, &sp, arg), &g);
+                if (r) {
+                    stack[sp++] = r;
+                } else if (op == OP_APPLY) {
+                    stack[sp++] = lcode_run(g);
+                } else {
+                    /* tail call: the callee replaces this frame */
+                    lenv_absorb(g->env, e);
+                    lval_del(f);
+                    f = g;
+                    code = f->code;
+                    e = f->env;
+                    pc = 0;
+                    if (code->depth > cap) {
+                        if (stack != small) { free(stack); }
+                        cap = code->depth;
+                        stack = malloc(sizeof(lval*) * cap);
+                    }
+                }
+            } break;
+            case OP_RET:
+                result = stack[--sp];
+                break;
+        }
+    }
+
+    if (stack != small) { free(stack); }
+    lval_del(f);
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef LISPY_VM_H
+#define LISPY_VM_H
+#include "lispy.h"
+
+/* Instructions. Each is an opcode followed by one operand, which is a
+   constant index, an argument count or a jump target */
+enum {
+    OP_CONST,   // push consts[i]
+    OP_LOAD,    // push the value bound to the symbol consts[i]
+    OP_LOCAL,   // push the value in slot i of the frame
+    OP_EVAL,    // push the tree walked value of the S-expression consts[i]
+    OP_IFDO,    // if the top is the do builtin pop it, else jump to target
+    OP_IFIF,    // if the top is the if builtin pop it, else jump to target
+    OP_DROP,    // pop, unless it is an error, then keep it and jump to target
+    OP_COND,    // turn the top into a boolean condition, on error jump to target
+    OP_JFALSE,  // pop the condition and jump to target if it is false
+    OP_JUMP,    // jump to target
+    OP_APPLY,   // pop n values and evaluate them as an S-expression
+    OP_TAIL,    // as OP_APPLY, but a lambda reuses the current frame
+    OP_RET      // return the top of the stack
+};
+
+/* a lambda body compiled to a flat instruction array */
+struct lcode {
+    int refs;
+    int* ops;
+    int count;
+    int cap;
+    lval** consts;
+    int nconsts;
+    int constcap;
+    int depth;      /* deepest the stack gets */
+    lenv* frame;    /* the frame shape while compiling, for resolving formals */
+};
+
+lcode* lcode_compile(lval* body, lenv* frame);
+lcode* lcode_retain(lcode* c);
+void   lcode_release(lcode* c);
+lval*  lcode_run(lval* f);
+
+#endif